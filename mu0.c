@@ -1,22 +1,75 @@
+#ifdef MU0_PYTHON
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
 
-#define LINE_SIZE 90
-#define MAX_LABEL_SIZE 90
 #define IO_ADDRESS 0xfff
+#define LOCK_ADDRESS 0xffe
+#define ARITH_ADDRESS 0xff9
 
 #define LABEL_C ':'
 #define NUM_LITERAL_C '#'
 #define CHAR_LITERAL_C '$'
 #define COMMENT_C ';'
+#define DIRECTIVE_C '.'
+#define SEGMENT_C '@'
 
 #define USAGE "Usage:\n\n"\
-    "1. mu0 assemble <assembly file> <machine code file> [-v]\n"\
-    "2. mu0 emulate <machine code file> [-v] [-l n]\n\n"\
+    "1. mu0 assemble <assembly file> <machine code file>... [-v] [-x] [-j n]\n"\
+    "   mu0 assemble --batch <list file> [-v] [-x] [-j n]\n"\
+    "2. mu0 emulate <machine code file> [-v] [-x] [-l n] [-c n [-r]] [--expect f]\n"\
+    "      [--cosim f] [--cache dir] [--vcd f | --wave f] [--arith n]\n"\
+    "3. mu0 batch <machine code file> <input file>... [-x] [-l n] [--cache dir] [--arith n]\n"\
+    "4. mu0 fuzz <machine code file> [seed file]... [-x] [-l n] [--runs n] [--seed n] [-o dir]\n"\
+    "5. mu0 wcet <machine code file> [-v] [-x] [--reads n]\n"\
+    "6. mu0 generate <assembly file> [--lines n] [--gap n] [--refs r] [--literals n] [--seed n]\n"\
+    "7. mu0 benchmark assemble [-x] [--gap n] [--refs r] [--literals n] [--max n] [--budget n]\n"\
+    "8. mu0 vcd <wave file> <vcd file>\n"\
+    "9. mu0 disassemble <machine code file> <assembly file>... [-x] [-j n]\n"\
+    "   mu0 disassemble --batch <list file> [-x] [-j n]\n"\
+    "10. mu0 superopt <assembly file> [-v] [-j n] [--scratch n] [--max n] [--seed n]\n"\
+    "11. mu0 compile <source file> <assembly file> [-x]\n"\
+    "12. mu0 specialize <machine code file> <known input file> <machine code file> [-x] [-l n]\n\n"\
     "    -v  : verbose\n"\
+    "    -x  : enable the extended instruction set\n"\
+    "    -j n: number of files to work on at once (default one per cpu)\n"\
     "    -l n: limit on the number of clock cycles to emulate\n"\
+    "    -c n: number of cores sharing the memory\n"\
+    "    -r  : relaxed, run each core on its own thread without lockstep\n"\
+    "    --arith n: map the multiply and divide unit, with results n cycles after B\n"\
+    "    --tier1 n: block entries before a block is predecoded (default 16, 0 off)\n"\
+    "    --tier2 n: block runs before a block is compiled (default 1000, 0 off)\n"\
+    "    --tier3 n: block runs before a trace is recorded from it (default 10000, 0 off)\n"\
+    "    --no-idioms: run array loops that store over their own operands step by step\n"\
+    "    --cold n : cycles between dropping blocks that have not run\n"\
+    "    --stats  : print how many blocks moved between tiers\n"\
+    "    --perf-map: name compiled blocks in /tmp/perf-<pid>.map for perf\n"\
+    "    --jitdump : also write them to jit-<pid>.dump for perf inject\n"\
+    "    --labels f: name blocks after the labels in assembly file f\n"\
+    "    --expect f: stop with status 1 as soon as the output differs from file f\n"\
+    "    --cosim f: compare every cycle with an RTL simulator through ring file f\n"\
+    "    --cache dir: reuse the results of runs already done, kept in dir\n"\
+    "    --vcd f  : write a waveform of the registers and memory bus to VCD file f\n"\
+    "    --wave f : write it in the compact format instead, for mu0 vcd to convert\n"\
+    "    --reads n: assume the program reads 0xfff at most n times\n"\
     "\n"\
     "The assembler chooses what to do with each line based on the first character(s)\n"\
     "of the line. If the first character is:\n"\
@@ -24,18 +77,137 @@
     "    ':' the next word is assumed to be a label.\n"\
     "    '#' the next number is stored at the next memory location.\n"\
     "    '$' the next character is stored as its ASCII representation.\n"\
+    "    '.org n' the words that follow go from address n on, leaving a gap.\n"\
     "If the line starts with one of the three letter commands\n"\
     "    LDA, STO, ADD, SUB, JMP, JGE, JNE\n"\
     "The opcode is stored and the next token is assumed to be the memory address.\n"\
     "If the memory address starts with a ':' it is assumed to be a label.\n"\
     "If the line starts with STP, 0 is stored at the next memory location.\n"\
     "\n"\
+    "Any number of assembly and machine code file pairs can be given. The list\n"\
+    "file for --batch has an assembly file per line, optionally followed by the\n"\
+    "machine code file, which defaults to the assembly file with .mu0 in place of\n"\
+    "its extension. A file with an unknown label is reported and not written, and\n"\
+    "the other files are still assembled.\n"\
+    "\n"\
+    "With -x the extended instructions use the spare opcodes:\n"\
+    "    LDI n: load the 12 bit number n into the accumulator\n"\
+    "    LDN a: load from the address held in memory location a\n"\
+    "    STN a: store to the address held in memory location a\n"\
+    "    SHL n: shift the accumulator left by n bits\n"\
+    "    SHR n: shift the accumulator right by n bits\n"\
+    "    AND a: bitwise and memory location a into the accumulator\n"\
+    "\n"\
     "The emulator expects a sequence of 4 digit hex numbers, one per line.\n"\
     "Memory location 0xfff is interpreted as memory-mapped IO. A LDA from 0xfff \n"\
-    "reads from stdin and a STO to 0xfff prints to stdout.\n"\
+    "reads from stdin and a STO to 0xfff prints to stdout. Memory words and the\n"\
+    "accumulator are 16 bit two's complement numbers: ADD, SUB and SHL wrap\n"\
+    "around, and JGE takes 0x8000 to 0xffff as negative.\n"\
+    "\n"\
+    "A line \"@a n\", both in hex, puts the next n words at address a on, and\n"\
+    "the words it skips over are zero. The assembler writes one for each .org, so\n"\
+    "an image with a table far from its code only holds the words in use, and\n"\
+    "loading it takes time in proportion to them.\n"\
+    "\n"\
+    "Programs that never store over their own code, use LDN or STN, or access\n"\
+    "memory out of range are found when loaded, and run without those checks.\n"\
+    "That engine wins over the --tier options: it runs everything the native\n"\
+    "tiers have not compiled, and all of it when they are off with --tier2 0.\n"\
+    "\n"\
+    "A batch runs the program once for each input file, as if the file was stdin,\n"\
+    "and writes what it prints to the input file name with .out added. The work\n"\
+    "before the first read of 0xfff is only done once and shared by every run.\n"\
+    "\n"\
+    "With --cache dir the output, the cycle count and how each run ended are kept\n"\
+    "in dir under hashes of the image, the input and the limit, and a run that has\n"\
+    "been done before is answered from there without emulating it. emulate then\n"\
+    "reads all of stdin before it starts and prints the output when it finishes.\n"\
+    "\n"\
+    "The fuzzer mutates the input, keeping inputs that take jumps in new ways.\n"\
+    "It writes them to dir/corpus-n, inputs that make the program access memory\n"\
+    "out of range to dir/crash-n and inputs that reach the step limit (100000 by\n"\
+    "default) to dir/hang-n. dir defaults to fuzz, --runs to 1000000.\n"\
+    "\n"\
+    "wcet prints an upper bound on the cycles the program can take, or the loop\n"\
+    "it can't bound, with status 1. Loops must end with LDA c, SUB k, STO c and\n"\
+    "JGE or JNE back to the start, or end with LDA c after such a count down at\n"\
+    "the start, where k is never stored to and c is set just before the loop.\n"\
+    "Loops that read 0xfff at the start of every pass are bounded by --reads.\n"\
+    "\n"\
+    "With --cosim each cycle is compared with an RTL simulator of the core. The\n"\
+    "emulator creates file f, best kept on /dev/shm, holding a ring that the\n"\
+    "simulator's testbench fills with the cycle number, PC, ACC, IR and any store\n"\
+    "after every clock cycle (cosim_ring_t in mu0.c). The run stops with status 1\n"\
+    "at the first cycle that differs, and sets stop in the ring when it ends.\n"\
+    "\n"\
+    "generate writes a synthetic source of --lines lines (default 1000) with a label\n"\
+    "every --gap lines (default 16, 0 for none). Instructions refer to the next\n"\
+    "label, the last one or one at random with --refs forward, backward or random\n"\
+    "(the default), and --literals percent of the lines (default 10) are literals.\n"\
+    "benchmark assemble assembles such sources of 1000 lines up to --max lines\n"\
+    "(default 10000000), ten times more each step, and prints the lines per second\n"\
+    "and the peak memory of each. It stops early once a step takes more than\n"\
+    "--budget seconds (default 60).\n"\
+    "Only sources of up to 4096 words make valid images, since past that label\n"\
+    "addresses no longer fit in an operand, so larger sizes only measure how fast\n"\
+    "the assembler runs.\n"\
+    "\n"\
+    "--vcd and --wave record PC, ACC, IR, state and the memory bus address, data,\n"\
+    "read and write after every cycle, writing only the signals that change, at\n"\
+    "one time unit per cycle. The compact format is several times smaller and\n"\
+    "faster to write, and mu0 vcd turns it into VCD for a waveform viewer.\n"\
+    "\n"\
+    "disassemble writes instructions for the words that can be reached from address\n"\
+    "0 and numbers for the rest, with a label Lxxx at each jump target and Dxxx at\n"\
+    "each other address an instruction refers to, so the text assembles back to the\n"\
+    "same image. Words the image skips over are skipped over again with .org, even\n"\
+    "where they are reached. The list file for --batch has a machine code file per\n"\
+    "line, with the assembly file defaulting to its name with .s in place of its\n"\
+    "extension.\n"\
+    "\n"\
+    "superopt searches for the shortest sequence of LDA, STO, ADD and SUB that\n"\
+    "leaves the accumulator and every cell named in a sequence of those\n"\
+    "instructions as the sequence does, using --scratch more cells (default 1)\n"\
+    "whose values don't matter, named :scratch0 and on. Candidates of up to --max\n"\
+    "instructions are tried on random states on -j threads, and one that passes\n"\
+    "is proved equal for every value before it is printed, with status 1 if\n"\
+    "there is none shorter.\n"\
+    "\n"\
+    "compile turns a small language into assembly:\n"\
+    "\n"\
+    "    var n = 10, a[16], t[3] = {1, 2, 3};\n"\
+    "    while n > 0 { n = n - 1; a[n] = in; }\n"\
+    "    do { out a[n] + '0'; n = n + 1; } while n != 10;\n"\
+    "    if t[0] == 1 { out 'y'; } else if n < 0 { stop; } else { out 'n'; }\n"\
+    "\n"\
+    "Variables are 16 bit memory cells, declared by var or by being assigned,\n"\
+    "and in and out read and write 0xfff. Expressions have +, -, * by a number\n"\
+    "and, with -x, &, << and >> by a number, and conditions compare two of them\n"\
+    "with ==, !=, <, <=, > or >=, or test one for not being zero. Constants are\n"\
+    "folded, loops test at the bottom, each condition is a single JGE or JNE\n"\
+    "where it can be, temporaries are reused, and a load of what the accumulator\n"\
+    "already holds is left out. Array elements are reached by patching a LDA or\n"\
+    "STO, or with LDN and STN with -x. // starts a comment.\n"\
     "\n"\
-    "Warnings: Lines must not exceed 90 characters\n"\
-    "    The code is not very robust. If the files don't match the requirements, \n"\
+    "specialize runs the program on the start of its input that is always the\n"\
+    "same, up to where it would read past it, and writes memory at that point as\n"\
+    "a new image that takes the rest of the input. The new image begins with a\n"\
+    "stub that prints what was printed so far, puts back address 0 and the\n"\
+    "accumulator, and jumps to the instruction that was about to read, so the\n"\
+    "set-up is not run again. An access past the end of the old image no longer\n"\
+    "faults, since the stub is there.\n"\
+    "\n"\
+    "With several cores each core starts at address 0 with its core number in\n"\
+    "the accumulator. Memory location 0xffe is a test-and-set lock: a LDA returns\n"\
+    "the old value and sets it to 1, a STO of 0 releases it.\n"\
+    "\n"\
+    "With --arith and one core there is a multiply and divide unit at 0xff9 to 0xffd.\n"\
+    "A STO to 0xff9 sets A and a STO to 0xffa sets B, and a LDA of 0xffb, 0xffc or\n"\
+    "0xffd then gives the low 16 bits of A * B, A / B or A % B. Reading a result\n"\
+    "stalls until n cycles after B was written. Division truncates, and dividing\n"\
+    "by zero gives -1 with A as the remainder.\n"\
+    "\n"\
+    "Warnings: The code is not very robust. If the files don't match the requirements, \n"\
     "    behaviour is undefined.\n"
     
 
@@ -47,11 +219,22 @@ enum opcode_t {
 	JMP = 4,
 	JGE = 5,
 	JNE = 6,
-	STP = 7
+	STP = 7,
+	/* extended instruction set, only decoded with -x */
+	LDI = 8,
+	LDN = 9,
+	STN = 10,
+	SHL = 11,
+	SHR = 12,
+	AND = 13
 };
 
-static char *opcode_str[8] = {
-    "LDA", "STO", "ADD", "SUB", "JMP", "JGE", "JNE", "STP"
+#define NUM_OPCODES 8
+#define NUM_EXT_OPCODES 14
+
+static char *opcode_str[NUM_EXT_OPCODES] = {
+    "LDA", "STO", "ADD", "SUB", "JMP", "JGE", "JNE", "STP",
+    "LDI", "LDN", "STN", "SHL", "SHR", "AND"
 };
 
 enum state_t {
@@ -59,416 +242,8327 @@ enum state_t {
     EXECUTE
 };
 
+/* How a run ended */
+enum outcome_t {
+    STOPPED,
+    LIMIT,
+    FAULT,
+    MISMATCH,
+    DIVERGED
+};
+
+/* Input and output held in memory rather than on stdin and stdout */
+typedef struct {
+    /* NULL to read stdin */
+    const unsigned char *input;
+    size_t input_size;
+    size_t input_pos;
+    /* kept in output, or printed to stdout if print is set */
+    int print;
+    unsigned char *output;
+    size_t output_size;
+    size_t output_cap;
+    size_t written;
+    /* when set each byte written must match the next byte of expect */
+    const unsigned char *expect;
+    size_t expect_size;
+    int mismatch;
+    unsigned char unexpected;
+} io_t;
+
+/* Registers of the arithmetic unit, from ARITH_ADDRESS up */
+enum arith_register_t {
+    ARITH_A,
+    ARITH_B,
+    ARITH_PRODUCT,
+    ARITH_QUOTIENT,
+    ARITH_REMAINDER,
+    ARITH_REGISTERS
+};
+
+typedef struct {
+    int latency;  /* cycles from writing B to the results, -1 when not mapped */
+    int a;
+    int b;
+    int ready;    /* cycle the results are ready on */
+} arith_t;
+
 typedef struct {
     unsigned int size;
-    unsigned int *data;
+    /* words are 16 bits, and sign extended when loaded into the accumulator */
+    uint16_t *data;
+    /* test-and-set lock at LOCK_ADDRESS, only mapped with several cores */
+    int lock_device;
+    unsigned int lock;
+    /* set while cores on several threads access data, which is then read
+     * and written with relaxed atomics */
+    int shared;
+    /* multiply and divide unit at ARITH_ADDRESS, timed by the core's cycle
+     * count in clock */
+    arith_t arith;
+    int *clock;
+    /* per address count of cached blocks, NULL unless tiering */
+    unsigned char *code;
+    int code_write;
+    /* NULL for stdin and stdout */
+    io_t *io;
+    /* where an out of range access or unexpected output goes instead of
+     * exiting, if set */
+    jmp_buf *fault;
+    int fault_address;
+    /* decoded program if the image passed the verifier, else NULL */
+    struct vinsn_t *verified;
 } memory_t;
 
-/* Labels stored in a linked list */
+typedef struct {
+    int PC;
+    int ACC;
+    int IR;
+    enum state_t state;
+    int done;
+    int steps;
+} cpu_t;
+
+/* Labels stored in a linked list. The label text is not copied, it points
+ * into the source buffer which outlives the table. */
 typedef struct label_table_t {
-    char *label;
+    const char *label;
+    int length;
     int address;
     struct label_table_t *next;
 } label_table_t;
 
+/* Label entries for a file come from chunks that are reused for the next
+ * file rather than freed one at a time */
+#define LABEL_CHUNK 256
+
+typedef struct label_chunk_t {
+    struct label_chunk_t *next;
+    label_table_t entries[LABEL_CHUNK];
+} label_chunk_t;
+
+typedef struct {
+    label_chunk_t *first;
+    label_chunk_t *current;
+    int used;  /* entries taken from current */
+} label_arena_t;
+
+/* Machine code text built up in memory and written out in one go */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t cap;
+} text_t;
+
+/* Assembly source held in memory, either mapped or read in one go */
+typedef struct {
+    const char *data;
+    size_t size;
+    int mapped;
+} source_t;
+
 /* ------------------------------------------- */
 /* ---------------- ASSEMBLER ---------------- */
 /* ------------------------------------------- */
 
-label_table_t *add_label(label_table_t *table, char *label, int address)
+/* Opcodes are looked up by packing the three characters of the mnemonic
+ * into an int and multiplying by a constant chosen so that every mnemonic
+ * lands in its own slot of the table. */
+#define OPCODE_HASH_BITS 5
+#define OPCODE_HASH_MUL 0x2fceu
+#define OPCODE_HASH_SIZE (1 << OPCODE_HASH_BITS)
+
+static unsigned int opcode_keys[OPCODE_HASH_SIZE];
+static signed char opcode_slots[OPCODE_HASH_SIZE];
+
+unsigned int pack_mnemonic(const char *s)
 {
-    label_table_t *new_table = malloc(sizeof(label_table_t));
-    new_table->label = strdup(label);
-    new_table->address = address;
-    new_table->next = table;
-    return new_table;
+    return (unsigned char) s[0]
+        | (unsigned char) s[1] << 8
+        | (unsigned char) s[2] << 16;
 }
 
-/* returns -1 if not found */
-int get_address(label_table_t *table, char *label)
+unsigned int opcode_hash(unsigned int key)
 {
-    if (table == NULL)
-    {
-        return -1;
-    }
-    else if (!strcmp(label, table->label))
-    {
-        return table->address;
-    }
-    else
+    return (key * OPCODE_HASH_MUL) >> (32 - OPCODE_HASH_BITS);
+}
+
+void build_opcode_table(void)
+{
+    int i;
+    unsigned int key;
+    unsigned int slot;
+    memset(opcode_slots, -1, sizeof(opcode_slots));
+    for (i = 0; i < NUM_EXT_OPCODES; i++)
     {
-        return get_address(table->next, label);
+        key = pack_mnemonic(opcode_str[i]);
+        slot = opcode_hash(key);
+        if (opcode_slots[slot] >= 0)
+        {
+            fprintf(stderr, "Opcode hash collision between %s and %s\n",
+                opcode_str[opcode_slots[slot]], opcode_str[i]);
+            exit(1);
+        }
+        opcode_keys[slot] = key;
+        opcode_slots[slot] = i;
     }
 }
 
-void free_table(label_table_t *table)
+/* returns -1 if the three characters at s are not a mnemonic */
+int lookup_opcode(const char *s, int extended)
 {
-    if (table != NULL)
+    unsigned int key = pack_mnemonic(s);
+    unsigned int slot = opcode_hash(key);
+    if (opcode_slots[slot] >= 0 && opcode_keys[slot] == key
+        && (extended || opcode_slots[slot] < NUM_OPCODES))
     {
-        free_table(table->next);
-        free(table->label);
-        free(table);
+        return opcode_slots[slot];
     }
+    return -1;
 }
 
-/* First pass of the file to resolve all the labels */
-label_table_t *generate_label_table(FILE *fin, int verbose)
+source_t *open_source(FILE *fin)
 {
-    label_table_t *table = NULL;
-    char line[LINE_SIZE];
-    char label[MAX_LABEL_SIZE];
-    int addr = 0;
-    
-    while (fgets(line, LINE_SIZE, fin) != NULL)
+    source_t *src;
+    struct stat st;
+    void *p;
+    size_t n;
+    size_t cap;
+    char *buf;
+
+    src = malloc(sizeof(source_t));
+    if (src == NULL)
     {
-        if (*line == LABEL_C)
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    if (fstat(fileno(fin), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fin), 0);
+        if (p != MAP_FAILED)
         {
-            sscanf(line + 1, "%s", label);
-            if (verbose)
-            {
-                printf("Found label definition \"%s\" at address %x\n", label, addr);
-            }
-            table = add_label(table, label, addr);
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            src->data = p;
+            src->size = st.st_size;
+            src->mapped = 1;
+            return src;
         }
-        else if (!isspace(*line) && (*line) != COMMENT_C)
+    }
+    /* Not a regular file (or mapping failed) so read the whole stream */
+    cap = 1 << 16;
+    n = 0;
+    buf = malloc(cap);
+    while (buf != NULL)
+    {
+        n += fread(buf + n, 1, cap - n, fin);
+        if (n < cap)
         {
-            addr++;
+            break;
         }
+        cap *= 2;
+        buf = realloc(buf, cap);
     }
-    rewind(fin);
-    return table;
+    if (buf == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    src->data = buf;
+    src->size = n;
+    src->mapped = 0;
+    return src;
 }
 
-/* Returns if the line was successfully parsed */
-int process_opcode(char *line, label_table_t *table, FILE *fout, int verbose)
+void close_source(source_t *src)
 {
-    int i;
-    char addr_s[MAX_LABEL_SIZE];
-    int addr;
-    for (i = 0; i < 8; i++)
+    if (src->mapped)
     {
-        if (!strncmp(line, opcode_str[i], 3)) {
-            /* Found opcode. Skip over opcode and get address. 
-             * If the opcode is STP there shouldn't be a memory address
-             * and this gives the empty string which becomes zero.
-             * It's just a fluke that this works but less cases is better, right? */
-            sscanf(line + 3, "%s", addr_s);
-            if (*addr_s == LABEL_C)
-            {
-                addr = get_address(table, addr_s + 1);
-                if (addr < 0)
-                {
-                    fprintf(stderr, "Unknown label \"%s\"\n", addr_s + 1);
-                    exit(1);
-                }
-            }
-            else
-            {
-                addr = strtol(addr_s, NULL, 0);
-            }
-            fprintf(fout, "%01x%03x\n", i, addr);
-            return 1;
-        }
+        munmap((void *) src->data, src->size);
     }
-    return 0;
+    else
+    {
+        free((void *) src->data);
+    }
+    free(src);
 }
 
-void assemble(FILE *fin, FILE *fout, int verbose) 
+/* Returns the start of the line after the one starting at p */
+const char *next_line(const char *p, const char *end)
 {
-    label_table_t *table;
-    char line[LINE_SIZE];
-    int line_ok;
+    const char *nl = memchr(p, '\n', end - p);
+    return nl == NULL ? end : nl + 1;
+}
 
-    table = generate_label_table(fin, verbose);
-    /* Iterate through all the lines. This is full of pointer magic
-     * which is why the code is so fragile.
-     */
-    while (fgets(line, LINE_SIZE, fin) != NULL)
+const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && isspace((unsigned char) *p))
     {
-        line_ok = 0;
-        if (*line == LABEL_C || *line == COMMENT_C || isspace(*line))
+        p++;
+    }
+    return p;
+}
+
+const char *skip_token(const char *p, const char *end)
+{
+    while (p < end && !isspace((unsigned char) *p))
+    {
+        p++;
+    }
+    return p;
+}
+
+/* Same rules as strtol with base 0, but stops at end rather than needing
+ * a terminating null (the source buffer doesn't have one) */
+long parse_number(const char *p, const char *end)
+{
+    long value = 0;
+    int negative = 0;
+    int base = 10;
+    int digit;
+
+    p = skip_space(p, end);
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+    if (p < end && *p == '0')
+    {
+        base = 8;
+        if (p + 2 < end && (p[1] == 'x' || p[1] == 'X') && isxdigit((unsigned char) p[2]))
         {
-            /* ignore line */
-            line_ok = 1;
+            base = 16;
+            p += 2;
         }
-        else if (*line == NUM_LITERAL_C)
+    }
+    for (; p < end; p++)
+    {
+        if (isdigit((unsigned char) *p))
         {
-            fprintf(fout, "%04lx\n", strtol(line+1, NULL, 0));
-            line_ok = 1;
+            digit = *p - '0';
         }
-        else if (*line == CHAR_LITERAL_C)
+        else if (isalpha((unsigned char) *p))
         {
-            fprintf(fout, "%04x\n", (int) line[1]);
-            line_ok = 1;
+            digit = tolower((unsigned char) *p) - 'a' + 10;
         }
         else
         {
-            line_ok = process_opcode(line, table, fout, verbose);
+            break;
         }
-        if (!line_ok)
+        if (digit >= base)
         {
-            fprintf(stderr, "Warning: Ignoring bad line: %s", line);
+            break;
         }
+        value = value * base + digit;
     }
-    free_table(table);
-	return;
+    return negative ? -value : value;
 }
 
-/* ------------------------------------------ */
-/* ---------------- EMULATOR ---------------- */
-/* ------------------------------------------ */
-
-int mem_size(FILE *fin)
+/* Returns space for n more characters at the end of the text */
+char *text_reserve(text_t *out, size_t n)
 {
-    int size = 0;
-    int operation;
-    while (fscanf(fin, "%x", &operation) == 1)
+    if (out->size + n > out->cap)
     {
-        size++;
+        out->cap = out->cap * 2 > out->size + n ? out->cap * 2 : out->size + n + 4096;
+        out->data = realloc(out->data, out->cap);
+        if (out->data == NULL)
+        {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
     }
-    rewind(fin);
-    return size;
+    return out->data + out->size;
 }
 
-/* one instruction per line, nothing else in file, addresses as hex */
-memory_t *read_machine_code(FILE *fin, int verbose)
+/* Writes a word as four hex digits and a newline */
+void emit_word(text_t *out, long word)
 {
-    memory_t *mem;
-    int i;
-    mem = malloc(sizeof(memory_t));
-    if (mem == NULL)
-    {
-        fprintf(stderr, "Memory allocation error\n");
-        exit(1);
-    }
-    mem->size = mem_size(fin);
-    mem->data = malloc(mem->size * sizeof(int));
-    if (mem->data == NULL)
-    {
-        fprintf(stderr, "Memory allocation error\n");
-        exit(1);
-    }
-    for (i = 0; i < mem->size; i++)
-    {
-        fscanf(fin, "%x", mem->data + i);
-    }
-    if (verbose)
+    static const char hex[] = "0123456789abcdef";
+    char *buf;
+    if (word < 0 || word > 0xffff)
     {
-        fprintf(stderr, "Read in %d lines\n", mem->size);
+        buf = text_reserve(out, 32);
+        out->size += snprintf(buf, 32, "%04lx\n", word);
+        return;
     }
-    return mem;
+    buf = text_reserve(out, 5);
+    buf[0] = hex[(word >> 12) & 0xf];
+    buf[1] = hex[(word >> 8) & 0xf];
+    buf[2] = hex[(word >> 4) & 0xf];
+    buf[3] = hex[word & 0xf];
+    buf[4] = '\n';
+    out->size += 5;
 }
 
-void free_mem(memory_t *mem)
+label_table_t *add_label(label_arena_t *arena, label_table_t *table, const char *label,
+    int length, int address)
 {
-    if (mem != NULL)
+    label_chunk_t *chunk;
+    label_table_t *new_table;
+    if (arena->current == NULL || arena->used == LABEL_CHUNK)
     {
-        free(mem->data);
-        free(mem);
+        chunk = arena->current != NULL ? arena->current->next : arena->first;
+        if (chunk == NULL)
+        {
+            chunk = malloc(sizeof(label_chunk_t));
+            if (chunk == NULL)
+            {
+                fprintf(stderr, "Memory allocation error\n");
+                exit(1);
+            }
+            chunk->next = NULL;
+            if (arena->current == NULL)
+            {
+                arena->first = chunk;
+            }
+            else
+            {
+                arena->current->next = chunk;
+            }
+        }
+        arena->current = chunk;
+        arena->used = 0;
     }
+    new_table = &arena->current->entries[arena->used++];
+    new_table->label = label;
+    new_table->length = length;
+    new_table->address = address;
+    new_table->next = table;
+    return new_table;
 }
 
-enum opcode_t get_opcode(int x)
+/* returns -1 if not found */
+int get_address(label_table_t *table, const char *label, int length)
 {
-    return x >> 12;
+    for (; table != NULL; table = table->next)
+    {
+        if (table->length == length && !memcmp(label, table->label, length))
+        {
+            return table->address;
+        }
+    }
+    return -1;
 }
 
-int get_operand(int x)
+/* Makes every entry available again, keeping the chunks */
+void reset_labels(label_arena_t *arena)
 {
-    return x & 0xfff;
+    arena->current = NULL;
+    arena->used = 0;
 }
 
-int get(memory_t *mem, int address)
+void free_labels(label_arena_t *arena)
 {
-    int x;
-    char c;
-    if (address == IO_ADDRESS)
-    {
-        scanf("%c", &c);
-        x = (int) c;
-    }
-    else if (address > mem->size)
+    label_chunk_t *next;
+    while (arena->first != NULL)
     {
-        fprintf(stderr, "Memory address 0x%x is out of range\n", address);
-        // exit code for SIGSEGV
-        exit(139);
-    }
-    else
-    {
-        x = mem->data[address];
+        next = arena->first->next;
+        free(arena->first);
+        arena->first = next;
     }
-    return x;
+    reset_labels(arena);
 }
 
-void set(memory_t *mem, int address, int value)
+/* Returns the address of a .org line, -1 if the line is not one, or
+ * IO_ADDRESS + 1 if the address is out of range */
+long origin(const char *line, const char *eol)
 {
-    if (address == IO_ADDRESS)
+    long addr;
+    if (eol - line < 5 || memcmp(line, ".org", 4) || !isspace((unsigned char) line[4]))
     {
-        printf("%c", value);
+        return -1;
     }
-    else if (address > mem->size)
+    addr = parse_number(line + 4, eol);
+    return addr >= 0 && addr <= IO_ADDRESS ? addr : IO_ADDRESS + 1;
+}
+
+/* Sets the count of the segment whose "@address count" line starts at
+ * header, now that the words after it are known, or drops the line if
+ * there are none */
+void end_segment(text_t *out, long header, int count)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *digits;
+    int i;
+    if (header >= 0 && count == 0)
     {
-        fprintf(stderr, "Memory address 0x%x is out of range\n", address);
-        exit(139);
+        out->size = header;
     }
-    else
+    else if (header >= 0)
     {
-        mem->data[address] = value;
+        digits = out->data + header + 5;
+        for (i = 3; i >= 0; i--, count >>= 4)
+        {
+            digits[i] = hex[count & 0xf];
+        }
     }
 }
 
-void emulate(memory_t *mem, int verbose, int limit)
+/* First pass of the source to resolve all the labels */
+label_table_t *generate_label_table(source_t *src, label_arena_t *arena, int verbose)
 {
-	int PC = 0;
-    int ACC = 0;
-    int IR = 0;
-    enum state_t state = FETCH;
-    int done = 0;
-    int steps = 0;
-    while (!done && (limit <= 0 || steps < limit))
+    label_table_t *table = NULL;
+    const char *line;
+    const char *end = src->data + src->size;
+    const char *eol;
+    const char *label;
+    int addr = 0;
+
+    for (line = src->data; line < end; line = eol)
     {
-        steps++;
-        if (verbose)
+        eol = next_line(line, end);
+        if (*line == LABEL_C)
         {
-            fprintf(stderr, "%3d: state = %7s, PC = %04x, ACC = %04x, IR = %04x\n", 
-                steps, state == FETCH ? "FETCH" : "EXECUTE", PC, ACC, IR);
+            label = skip_space(line + 1, eol);
+            if (verbose)
+            {
+                printf("Found label definition \"%.*s\" at address %x\n",
+                    (int) (skip_token(label, eol) - label), label, addr);
+            }
+            table = add_label(arena, table, label, skip_token(label, eol) - label, addr);
         }
-        if (state == FETCH)
+        else if (*line == DIRECTIVE_C && origin(line, eol) >= addr)
         {
-            IR = get(mem, PC++);
-            state = EXECUTE;
+            addr = origin(line, eol);
         }
-        else
+        else if (!isspace((unsigned char) *line) && (*line) != COMMENT_C)
         {
-            switch (get_opcode(IR))
-            {
-                case LDA:
-                    ACC = get(mem, get_operand(IR));
-                    state = FETCH;
-                    break;
-                case STO:
-                    set(mem, get_operand(IR), ACC);
-                    state = FETCH;
-                    break;
-                case ADD:
-                    ACC += get(mem, get_operand(IR));
-                    state = FETCH;
-                    break;
-                case SUB:
-                    ACC -= get(mem, get_operand(IR));
-                    state = FETCH;
-                    break;
-                case JMP:
-                    PC = get_operand(IR);
-                    IR = get(mem, PC++);
-                    break;
-                case JGE:
-                    if (ACC >= 0)
-                    {
-                        PC = get_operand(IR);
-                        IR = get(mem, PC++);
-                    }
-                    else
-                    {
-                        state = FETCH;
-                    }
-                    break;
-                case JNE:
-                    if (ACC != 0)
-                    {
-                        PC = get_operand(IR);
-                        IR = get(mem, PC++);
-                    }
-                    else
-                    {
-                        state = FETCH;
-                    }
-                    break;
-                case STP:
-                    done = 1;
-                    break;
-            }
+            addr++;
         }
     }
-    if (!done)
-    {
-        fprintf(stderr, "Step limit exceeded\n");
-    }
+    return table;
 }
 
-int is_verbose(int argc, char **argv)
+/* Returns 1 for an instruction, 0 if the line isn't one or -1 if it uses
+ * an unknown label */
+int process_opcode(const char *line, const char *eol, label_table_t *table, text_t *out,
+    const char *name, int extended)
 {
-    int i;
-    for (i = 0; i < argc; i++)
+    int op;
+    const char *addr_s;
+    const char *addr_end;
+    long addr;
+
+    if (eol - line < 3 || (op = lookup_opcode(line, extended)) < 0)
+    {
+        return 0;
+    }
+    /* Found opcode. Skip over opcode and get address. 
+     * If the opcode is STP there is no memory address and it becomes zero. */
+    addr_s = skip_space(line + 3, eol);
+    addr_end = skip_token(addr_s, eol);
+    if (addr_s < addr_end && *addr_s == LABEL_C)
     {
-        if (!strcmp(argv[i], "-v"))
+        addr = get_address(table, addr_s + 1, addr_end - addr_s - 1);
+        if (addr < 0)
         {
-            return 1;
+            fprintf(stderr, "%s: Unknown label \"%.*s\"\n", name, (int) (addr_end - addr_s - 1),
+                addr_s + 1);
+            return -1;
         }
     }
-    return 0;
+    else
+    {
+        addr = parse_number(addr_s, addr_end);
+    }
+    if (addr >= 0 && addr <= 0xfff)
+    {
+        emit_word(out, op << 12 | addr);
+    }
+    else
+    {
+        out->size += snprintf(text_reserve(out, 32), 32, "%01x%03lx\n", op, addr);
+    }
+    return 1;
 }
 
-/* Returns zero if not specified */
-int step_limit(int argc, char **argv)
+/* Assembles src into out. Returns the number of unknown labels. */
+int assemble_source(source_t *src, label_arena_t *arena, text_t *out, const char *name,
+    int verbose, int extended)
+{
+    label_table_t *table;
+    const char *line;
+    const char *eol;
+    const char *end;
+    int line_ok;
+    int errors = 0;
+    int addr = 0;
+    int start = 0;
+    long header = -1;
+    long org;
+
+    end = src->data + src->size;
+    table = generate_label_table(src, arena, verbose);
+    /* Iterate through all the lines. Each line is looked at in place in
+     * the source buffer, so nothing limits how long a line can be. */
+    for (line = src->data; line < end; line = eol)
+    {
+        eol = next_line(line, end);
+        line_ok = 0;
+        if (*line == LABEL_C || *line == COMMENT_C || isspace((unsigned char) *line))
+        {
+            /* ignore line */
+            line_ok = 1;
+        }
+        else if (*line == NUM_LITERAL_C)
+        {
+            emit_word(out, parse_number(line + 1, eol));
+            addr++;
+            line_ok = 1;
+        }
+        else if (*line == CHAR_LITERAL_C)
+        {
+            emit_word(out, line + 1 < end ? (int) line[1] : 0);
+            addr++;
+            line_ok = 1;
+        }
+        else if (*line == DIRECTIVE_C && (org = origin(line, eol)) >= 0)
+        {
+            if (org > IO_ADDRESS)
+            {
+                fprintf(stderr, "%s: .org address out of range: %.*s", name, (int) (eol - line), line);
+                line_ok = -1;
+            }
+            else if (org < addr)
+            {
+                fprintf(stderr, "%s: .org 0x%03lx is before address 0x%03x\n", name, org, addr);
+                line_ok = -1;
+            }
+            else
+            {
+                /* the words skipped over are left out, and read as zero */
+                end_segment(out, header, addr - start);
+                header = out->size;
+                out->size += snprintf(text_reserve(out, 16), 16, "%c%03lx 0000\n", SEGMENT_C, org);
+                addr = start = org;
+                line_ok = 1;
+            }
+        }
+        else
+        {
+            line_ok = process_opcode(line, eol, table, out, name, extended);
+            addr += line_ok > 0;
+        }
+        if (line_ok < 0)
+        {
+            errors++;
+        }
+        else if (!line_ok)
+        {
+            fprintf(stderr, "%s: Warning: Ignoring bad line: %.*s", name, (int) (eol - line), line);
+        }
+    }
+    end_segment(out, header, addr - start);
+    return errors;
+}
+
+/* A build assembles many files at once. Each thread takes the next file
+ * from the list and keeps its own label entries and output text, which
+ * are reused from one file to the next. The disassembler uses the same
+ * pool with its own function for each file. */
+
+typedef struct {
+    char *input;
+    char *output;
+} assembly_job_t;
+
+/* Returns if the file was processed and written */
+typedef int (*job_fn)(assembly_job_t *job, label_arena_t *arena, text_t *out, int verbose,
+    int extended);
+
+typedef struct {
+    assembly_job_t *jobs;
+    int count;
+    int next;
+    int failed;
+    int verbose;
+    int extended;
+    job_fn process;
+} assembly_pool_t;
+
+/* Returns if the file assembled and was written */
+int assemble_file(assembly_job_t *job, label_arena_t *arena, text_t *out, int verbose, int extended)
+{
+    FILE *f;
+    source_t *src;
+    int errors;
+
+    f = fopen(job->input, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", job->input);
+        return 0;
+    }
+    src = open_source(f);
+    fclose(f);
+    reset_labels(arena);
+    out->size = 0;
+    errors = assemble_source(src, arena, out, job->input, verbose, extended);
+    close_source(src);
+    if (errors > 0)
+    {
+        return 0;
+    }
+    f = fopen(job->output, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", job->output);
+        return 0;
+    }
+    fwrite(out->data, 1, out->size, f);
+    fclose(f);
+    return 1;
+}
+
+void *assembly_worker(void *arg)
+{
+    assembly_pool_t *pool = arg;
+    label_arena_t arena;
+    text_t out;
+    int i;
+
+    memset(&arena, 0, sizeof(arena));
+    memset(&out, 0, sizeof(out));
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+    {
+        if (!pool->process(&pool->jobs[i], &arena, &out, pool->verbose, pool->extended))
+        {
+            __atomic_fetch_add(&pool->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free_labels(&arena);
+    free(out.data);
+    return NULL;
+}
+
+/* Returns the number of files that failed */
+int run_jobs(assembly_job_t *jobs, int count, int threads, int verbose, int extended,
+    job_fn process)
+{
+    assembly_pool_t pool;
+    pthread_t *workers;
+    int i;
+
+    pool.process = process;
+    pool.jobs = jobs;
+    pool.count = count;
+    pool.next = 0;
+    pool.failed = 0;
+    pool.verbose = verbose;
+    pool.extended = extended;
+    if (threads > count)
+    {
+        threads = count;
+    }
+    if (threads <= 1)
+    {
+        assembly_worker(&pool);
+        return pool.failed;
+    }
+    workers = malloc(threads * sizeof(pthread_t));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&workers[i], NULL, assembly_worker, &pool) != 0)
+        {
+            fprintf(stderr, "Could not start worker %d\n", i);
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    return pool.failed;
+}
+
+int assemble(assembly_job_t *jobs, int count, int threads, int verbose, int extended)
+{
+    build_opcode_table();
+    return run_jobs(jobs, count, threads, verbose, extended, assemble_file);
+}
+
+/* Reads lines of "input [output]" from a list file, where the output
+ * defaults to the input with its extension replaced by extension */
+assembly_job_t *read_job_list(const char *name, int *count, const char *extension)
+{
+    FILE *f;
+    source_t *src;
+    assembly_job_t *jobs;
+    const char *line;
+    const char *eol;
+    const char *end;
+    const char *word;
+    const char *word_end;
+    const char *dot;
+    int n = 0;
+
+    f = fopen(name, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", name);
+        exit(1);
+    }
+    src = open_source(f);
+    fclose(f);
+    end = src->data + src->size;
+    jobs = malloc((src->size / 2 + 1) * sizeof(assembly_job_t));
+    if (jobs == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    for (line = src->data; line < end; line = eol)
+    {
+        eol = next_line(line, end);
+        word = skip_space(line, eol);
+        word_end = skip_token(word, eol);
+        if (word == word_end || *word == COMMENT_C)
+        {
+            continue;
+        }
+        jobs[n].input = strndup(word, word_end - word);
+        word = skip_space(word_end, eol);
+        word_end = skip_token(word, eol);
+        if (word < word_end)
+        {
+            jobs[n].output = strndup(word, word_end - word);
+        }
+        else
+        {
+            dot = strrchr(jobs[n].input, '.');
+            word_end = dot != NULL && strchr(dot, '/') == NULL ? dot : jobs[n].input + strlen(jobs[n].input);
+            jobs[n].output = malloc(word_end - jobs[n].input + strlen(extension) + 1);
+            if (jobs[n].output != NULL)
+            {
+                sprintf(jobs[n].output, "%.*s%s", (int) (word_end - jobs[n].input), jobs[n].input,
+                    extension);
+            }
+        }
+        if (jobs[n].input == NULL || jobs[n].output == NULL)
+        {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
+        n++;
+    }
+    close_source(src);
+    *count = n;
+    return jobs;
+}
+
+
+/* ------------------------------------------ */
+/* ---------------- EMULATOR ---------------- */
+/* ------------------------------------------ */
+
+/* Reads the next word of an image, returning the address it goes to or -1
+ * at the end. Words run on from address 0, and a line "@address count"
+ * starts a segment of count words at address, with the words skipped over
+ * left as zero. */
+int next_word(FILE *fin, int *address, unsigned int *word)
+{
+    unsigned int segment;
+    int count;
+    while (fscanf(fin, " @%x %x", &segment, &count) == 2)
+    {
+        if (segment > IO_ADDRESS)
+        {
+            fprintf(stderr, "Segment address out of range: @%x\n", segment);
+            exit(1);
+        }
+        *address = segment;
+    }
+    if (fscanf(fin, "%x", word) != 1)
+    {
+        return -1;
+    }
+    return (*address)++;
+}
+
+int mem_size(FILE *fin)
+{
+    int size = 0;
+    int address = 0;
+    unsigned int word;
+    while (next_word(fin, &address, &word) >= 0)
+    {
+        size = address > size ? address : size;
+    }
+    rewind(fin);
+    return size;
+}
+
+/* one instruction per line, nothing else in file, addresses as hex */
+memory_t *read_machine_code(FILE *fin, int verbose)
+{
+    memory_t *mem;
+    unsigned int word;
+    int address = 0;
+    int words = 0;
+    int i;
+    mem = malloc(sizeof(memory_t));
+    if (mem == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    mem->size = mem_size(fin);
+    mem->lock_device = 0;
+    mem->lock = 0;
+    mem->shared = 0;
+    memset(&mem->arith, 0, sizeof(arith_t));
+    mem->arith.latency = -1;
+    mem->clock = NULL;
+    mem->code = NULL;
+    mem->code_write = -1;
+    mem->io = NULL;
+    mem->fault = NULL;
+    mem->fault_address = 0;
+    mem->verified = NULL;
+    /* one spare word, since address size is allowed through */
+    mem->data = calloc(mem->size + 1, sizeof(uint16_t));
+    if (mem->data == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    while ((i = next_word(fin, &address, &word)) >= 0)
+    {
+        mem->data[i] = word;
+        words++;
+    }
+    if (verbose)
+    {
+        fprintf(stderr, "Read in %d lines\n", words);
+    }
+    return mem;
+}
+
+void free_mem(memory_t *mem)
+{
+    if (mem != NULL)
+    {
+        free(mem->data);
+        free(mem->verified);
+        free(mem);
+    }
+}
+
+enum opcode_t get_opcode(int x)
+{
+    return x >> 12;
+}
+
+int get_operand(int x)
+{
+    return x & 0xfff;
+}
+
+void out_of_range(memory_t *mem, int address)
+{
+    if (mem->fault != NULL)
+    {
+        mem->fault_address = address;
+        longjmp(*mem->fault, FAULT);
+    }
+    fprintf(stderr, "Memory address 0x%x is out of range\n", address);
+    // exit code for SIGSEGV
+    exit(139);
+}
+
+int read_input(io_t *io)
+{
+    char c;
+    /* reads past the end of the input give EOF */
+    if (io == NULL || io->input == NULL)
+    {
+        return scanf("%c", &c) == 1 ? (int) c : EOF;
+    }
+    if (io->input_pos < io->input_size)
+    {
+        return (char) io->input[io->input_pos++];
+    }
+    return EOF;
+}
+
+void write_output(io_t *io, int value)
+{
+    if (io == NULL)
+    {
+        printf("%c", value);
+        return;
+    }
+    if (io->expect != NULL
+        && (io->written >= io->expect_size || io->expect[io->written] != (unsigned char) value))
+    {
+        io->mismatch = 1;
+        io->unexpected = value;
+        return;
+    }
+    io->written++;
+    if (io->print)
+    {
+        printf("%c", value);
+        return;
+    }
+    if (io->output_size == io->output_cap)
+    {
+        io->output_cap = io->output_cap ? 2 * io->output_cap : 256;
+        io->output = realloc(io->output, io->output_cap);
+        if (io->output == NULL)
+        {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
+    }
+    io->output[io->output_size++] = value;
+}
+
+int is_arith(memory_t *mem, int address)
+{
+    return mem->arith.latency >= 0 && address >= ARITH_ADDRESS
+        && address < ARITH_ADDRESS + ARITH_REGISTERS;
+}
+
+/* Reads a register of the arithmetic unit, stalling the core until the
+ * results are ready. Division is signed and truncates, and dividing by zero
+ * gives a quotient of -1 and leaves A as the remainder. */
+int read_arith(memory_t *mem, enum arith_register_t r)
+{
+    arith_t *unit = &mem->arith;
+    if (mem->clock != NULL && r >= ARITH_PRODUCT && *mem->clock < unit->ready)
+    {
+        *mem->clock = unit->ready;
+    }
+    switch (r)
+    {
+        case ARITH_A:
+            return unit->a & 0xffff;
+        case ARITH_B:
+            return unit->b & 0xffff;
+        case ARITH_PRODUCT:
+            return (unit->a * unit->b) & 0xffff;
+        case ARITH_QUOTIENT:
+            return (unit->b == 0 ? -1 : unit->a / unit->b) & 0xffff;
+        default:
+            return (unit->b == 0 ? unit->a : unit->a % unit->b) & 0xffff;
+    }
+}
+
+/* Writing B starts the operation on A and B */
+void write_arith(memory_t *mem, enum arith_register_t r, int value)
+{
+    arith_t *unit = &mem->arith;
+    if (r == ARITH_A)
+    {
+        unit->a = (int16_t) value;
+    }
+    else if (r == ARITH_B)
+    {
+        unit->b = (int16_t) value;
+        unit->ready = (mem->clock != NULL ? *mem->clock : 0) + unit->latency;
+    }
+}
+
+int get(memory_t *mem, int address)
+{
+    int x;
+    if (address == IO_ADDRESS)
+    {
+        x = read_input(mem->io);
+    }
+    else if (address == LOCK_ADDRESS && mem->lock_device)
+    {
+        /* test-and-set: returns the old value and leaves the lock taken */
+        x = __atomic_exchange_n(&mem->lock, 1, __ATOMIC_ACQUIRE);
+    }
+    else if (is_arith(mem, address))
+    {
+        x = read_arith(mem, address - ARITH_ADDRESS);
+    }
+    else if (address > mem->size)
+    {
+        out_of_range(mem, address);
+    }
+    else if (mem->shared)
+    {
+        x = __atomic_load_n(&mem->data[address], __ATOMIC_RELAXED);
+    }
+    else
+    {
+        x = mem->data[address];
+    }
+    return x;
+}
+
+/* Reads a value for the accumulator, where a memory word is taken as a
+ * signed 16 bit number */
+int load(memory_t *mem, int address)
+{
+    return (int16_t) get(mem, address);
+}
+
+void set(memory_t *mem, int address, int value)
+{
+    if (address == IO_ADDRESS)
+    {
+        write_output(mem->io, value);
+        if (mem->io != NULL && mem->io->mismatch && mem->fault != NULL)
+        {
+            longjmp(*mem->fault, MISMATCH);
+        }
+    }
+    else if (address == LOCK_ADDRESS && mem->lock_device)
+    {
+        __atomic_store_n(&mem->lock, value, __ATOMIC_RELEASE);
+    }
+    else if (is_arith(mem, address))
+    {
+        write_arith(mem, address - ARITH_ADDRESS, value);
+    }
+    else if (address > mem->size)
+    {
+        out_of_range(mem, address);
+        return;
+    }
+    else if (mem->shared)
+    {
+        __atomic_store_n(&mem->data[address], value, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        mem->data[address] = value;
+        if (mem->code != NULL && mem->code[address])
+        {
+            mem->code_write = address;
+        }
+    }
+}
+
+void init_cpu(cpu_t *cpu, int acc)
+{
+    cpu->PC = 0;
+    cpu->ACC = acc;
+    cpu->IR = 0;
+    cpu->state = FETCH;
+    cpu->done = 0;
+    cpu->steps = 0;
+}
+
+/* Core is -1 when there is only one */
+void trace_cycle(cpu_t *cpu, int core)
+{
+    if (core >= 0)
+    {
+        fprintf(stderr, "core %d ", core);
+    }
+    fprintf(stderr, "%3d: state = %7s, PC = %04x, ACC = %04x, IR = %04x\n", 
+        cpu->steps, cpu->state == FETCH ? "FETCH" : "EXECUTE", cpu->PC, cpu->ACC, cpu->IR);
+}
+
+/* Runs a single clock cycle */
+void cycle(cpu_t *cpu, memory_t *mem, int extended)
+{
+    if (cpu->state == FETCH)
+    {
+        cpu->IR = get(mem, cpu->PC++);
+        cpu->state = EXECUTE;
+    }
+    else if (extended || get_opcode(cpu->IR) < NUM_OPCODES)
+    {
+        switch (get_opcode(cpu->IR))
+        {
+            case LDA:
+                cpu->ACC = load(mem, get_operand(cpu->IR));
+                cpu->state = FETCH;
+                break;
+            case STO:
+                set(mem, get_operand(cpu->IR), cpu->ACC);
+                cpu->state = FETCH;
+                break;
+            case ADD:
+                cpu->ACC = (int16_t) (cpu->ACC + load(mem, get_operand(cpu->IR)));
+                cpu->state = FETCH;
+                break;
+            case SUB:
+                cpu->ACC = (int16_t) (cpu->ACC - load(mem, get_operand(cpu->IR)));
+                cpu->state = FETCH;
+                break;
+            case JMP:
+                cpu->PC = get_operand(cpu->IR);
+                cpu->IR = get(mem, cpu->PC++);
+                break;
+            case JGE:
+                if (cpu->ACC >= 0)
+                {
+                    cpu->PC = get_operand(cpu->IR);
+                    cpu->IR = get(mem, cpu->PC++);
+                }
+                else
+                {
+                    cpu->state = FETCH;
+                }
+                break;
+            case JNE:
+                if (cpu->ACC != 0)
+                {
+                    cpu->PC = get_operand(cpu->IR);
+                    cpu->IR = get(mem, cpu->PC++);
+                }
+                else
+                {
+                    cpu->state = FETCH;
+                }
+                break;
+            case STP:
+                cpu->done = 1;
+                break;
+            case LDI:
+                cpu->ACC = get_operand(cpu->IR);
+                cpu->state = FETCH;
+                break;
+            case LDN:
+                cpu->ACC = load(mem, get_operand(get(mem, get_operand(cpu->IR))));
+                cpu->state = FETCH;
+                break;
+            case STN:
+                set(mem, get_operand(get(mem, get_operand(cpu->IR))), cpu->ACC);
+                cpu->state = FETCH;
+                break;
+            case SHL:
+                cpu->ACC = (int16_t) ((unsigned int) cpu->ACC << (get_operand(cpu->IR) & 0x1f));
+                cpu->state = FETCH;
+                break;
+            case SHR:
+                cpu->ACC >>= get_operand(cpu->IR) & 0x1f;
+                cpu->state = FETCH;
+                break;
+            case AND:
+                cpu->ACC &= load(mem, get_operand(cpu->IR));
+                cpu->state = FETCH;
+                break;
+        }
+    }
+}
+
+int within_limit(cpu_t *cpu, int limit)
+{
+    return limit <= 0 || cpu->steps < limit;
+}
+
+/* Runs a core until it stops or reaches the limit. Returns if it stopped. */
+int run(cpu_t *cpu, memory_t *mem, int verbose, int extended, int limit, int core)
+{
+    while (!cpu->done && within_limit(cpu, limit))
+    {
+        cpu->steps++;
+        if (verbose)
+        {
+            trace_cycle(cpu, core);
+        }
+        cycle(cpu, mem, extended);
+    }
+    return cpu->done;
+}
+
+/* ------------------------------------------- */
+/* ------------------ TIERS ------------------ */
+/* ------------------------------------------- */
+
+/* Straight line runs of instructions are counted each time execution
+ * reaches their first address. Hot ones are decoded once into a block
+ * (the predecoded tier) and the hottest are compiled to native code.
+ * A block ends after its first jump or STP, so it always executes from
+ * start to end unless a store lands on code. */
+
+#define MAX_BLOCK_LENGTH 64
+#define SMC_LIMIT 2
+#define NATIVE_ARENA_SIZE (4 << 20)
+#define NATIVE_BLOCK_MAX (MAX_BLOCK_LENGTH * 192)
+#define TRACE_MAX_LENGTH 256
+#define TRACE_REGISTERS 8
+#define NATIVE_TRACE_MAX (TRACE_MAX_LENGTH * 512)
+
+enum tier_t {
+    INTERPRETED,
+    PREDECODED,
+    NATIVE
+};
+
+typedef struct {
+    int tier1;   /* block entries before predecoding, 0 never */
+    int tier2;   /* block runs before compiling to native code, 0 never */
+    int tier3;   /* block runs before recording a trace from it, 0 never */
+    int idioms;  /* run self-modifying array loops in one pass */
+    int cold;    /* cycles between dropping blocks that did not run */
+    int stats;   /* print the transition counts at the end */
+    int perf_map;  /* name compiled blocks in /tmp/perf-<pid>.map */
+    int jitdump;   /* and in jit-<pid>.dump for perf inject */
+    source_t *source;  /* assembly the labels come from, or NULL */
+    label_table_t *labels;
+    label_arena_t label_arena;
+} tiering_t;
+
+typedef struct {
+    long predecoded;
+    long native;
+    long traces;
+    long idioms;
+    long self_modified;
+    long cold;
+} tier_stats_t;
+
+typedef struct {
+    enum opcode_t op;
+    int operand;
+    int word;
+    int direct;  /* operand is an ordinary in range memory address */
+} insn_t;
+
+typedef int (*native_fn)(cpu_t *cpu, memory_t *mem);
+
+/* Returns like native_fn, or -1 without running if the cells it keeps in
+ * registers have become code */
+typedef int (*trace_fn)(cpu_t *cpu, memory_t *mem, int iterations);
+
+/* A hot loop as the blocks it ran through, from the block at head back to
+ * it, compiled into one native loop that keeps its busiest cells in host
+ * registers until it leaves the loop or calls out for IO */
+typedef struct trace {
+    int head;
+    int length;
+    insn_t insns[TRACE_MAX_LENGTH];
+    int addresses[TRACE_MAX_LENGTH];
+    char taken[TRACE_MAX_LENGTH];  /* the jump was taken when recorded */
+    int cells[TRACE_REGISTERS];  /* -1 for an unused register */
+    char written[TRACE_REGISTERS];
+    trace_fn native;
+    int native_size;
+    struct trace *next;
+} trace_t;
+
+typedef struct {
+    int start;
+    int length;
+    enum tier_t tier;
+    long runs;
+    int recent;
+    insn_t insns[MAX_BLOCK_LENGTH];
+    native_fn native;
+    int native_size;
+    trace_t *trace;  /* the loop starting here */
+} block_t;
+
+typedef struct {
+    tiering_t config;
+    tier_stats_t stats;
+    int size;
+    /* per address metadata, held as separate arrays in one allocation so
+     * the dispatch loop touches a few dense cache lines */
+    void *metadata;
+    block_t **blocks;
+    uint16_t *entries;
+    unsigned char *smc;
+    /* set where no block could be built, until a store lands there */
+    unsigned char *uncached;
+    unsigned char *arena;
+    int arena_used;
+    int next_cold;
+    FILE *perf_map;
+    FILE *jitdump;
+    void *jitdump_marker;
+    long code_index;
+    trace_t *traces;
+    trace_t *recording;  /* the trace being recorded */
+} tiers_t;
+
+/* Host profilers only see anonymous code in the arena, so each compiled
+ * block is named after its mu0 address and the nearest label before it,
+ * in the perf map format and optionally as a jitdump for perf inject. */
+
+#define JITDUMP_MAGIC 0x4a695444
+#define JIT_CODE_LOAD 0
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int total_size;
+    unsigned int elf_mach;
+    unsigned int pad1;
+    unsigned int pid;
+    unsigned long timestamp;
+    unsigned long flags;
+} jitdump_header_t;
+
+typedef struct {
+    unsigned int id;
+    unsigned int total_size;
+    unsigned long timestamp;
+    unsigned int pid;
+    unsigned int tid;
+    unsigned long vma;
+    unsigned long code_addr;
+    unsigned long code_size;
+    unsigned long code_index;
+} jitdump_load_t;
+
+unsigned long monotonic_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+void open_profiler_maps(tiers_t *t)
+{
+    char name[64];
+    jitdump_header_t header;
+    if (t->config.perf_map)
+    {
+        snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int) getpid());
+        t->perf_map = fopen(name, "w");
+        if (t->perf_map == NULL)
+        {
+            fprintf(stderr, "Could not open %s\n", name);
+        }
+    }
+    if (t->config.jitdump)
+    {
+        snprintf(name, sizeof(name), "jit-%d.dump", (int) getpid());
+        t->jitdump = fopen(name, "w+");
+        if (t->jitdump == NULL)
+        {
+            fprintf(stderr, "Could not open %s\n", name);
+            return;
+        }
+        memset(&header, 0, sizeof(header));
+        header.magic = JITDUMP_MAGIC;
+        header.version = 1;
+        header.total_size = sizeof(header);
+        header.elf_mach = 62;  /* EM_X86_64 */
+        header.pid = getpid();
+        header.timestamp = monotonic_time();
+        fwrite(&header, sizeof(header), 1, t->jitdump);
+        fflush(t->jitdump);
+        /* perf finds the dump by this executable mapping of it */
+        t->jitdump_marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE,
+            fileno(t->jitdump), 0);
+        if (t->jitdump_marker == MAP_FAILED)
+        {
+            t->jitdump_marker = NULL;
+        }
+    }
+}
+
+void close_profiler_maps(tiers_t *t)
+{
+    if (t->perf_map != NULL)
+    {
+        fclose(t->perf_map);
+    }
+    if (t->jitdump_marker != NULL)
+    {
+        munmap(t->jitdump_marker, sysconf(_SC_PAGESIZE));
+    }
+    if (t->jitdump != NULL)
+    {
+        fclose(t->jitdump);
+    }
+}
+
+/* Writes "<kind> 0x<address> <label>+<offset>" for code starting at start */
+void code_name(tiers_t *t, const char *kind, int start, char *name, int size)
+{
+    label_table_t *l;
+    label_table_t *best = NULL;
+    for (l = t->config.labels; l != NULL; l = l->next)
+    {
+        if (l->address <= start && (best == NULL || l->address > best->address))
+        {
+            best = l;
+        }
+    }
+    if (best == NULL)
+    {
+        snprintf(name, size, "%s 0x%03x", kind, start);
+    }
+    else if (best->address == start)
+    {
+        snprintf(name, size, "%s 0x%03x %.*s", kind, start, best->length, best->label);
+    }
+    else
+    {
+        snprintf(name, size, "%s 0x%03x %.*s+%d", kind, start, best->length, best->label,
+            start - best->address);
+    }
+}
+
+void publish_code(tiers_t *t, const char *kind, int start, void *code, int code_size)
+{
+    char name[128];
+    jitdump_load_t load;
+    if (t->perf_map == NULL && t->jitdump == NULL)
+    {
+        return;
+    }
+    code_name(t, kind, start, name, sizeof(name));
+    if (t->perf_map != NULL)
+    {
+        fprintf(t->perf_map, "%lx %x %s\n", (unsigned long) code, code_size, name);
+        fflush(t->perf_map);
+    }
+    if (t->jitdump != NULL)
+    {
+        load.id = JIT_CODE_LOAD;
+        load.total_size = sizeof(load) + strlen(name) + 1 + code_size;
+        load.timestamp = monotonic_time();
+        load.pid = getpid();
+        load.tid = getpid();
+        load.vma = (unsigned long) code;
+        load.code_addr = (unsigned long) code;
+        load.code_size = code_size;
+        load.code_index = t->code_index++;
+        fwrite(&load, sizeof(load), 1, t->jitdump);
+        fwrite(name, strlen(name) + 1, 1, t->jitdump);
+        fwrite(code, code_size, 1, t->jitdump);
+        fflush(t->jitdump);
+    }
+}
+
+tiers_t *new_tiers(memory_t *mem, const tiering_t *config)
+{
+    size_t n;
+    tiers_t *t = calloc(1, sizeof(tiers_t));
+    if (t == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    t->config = *config;
+    if (t->config.tier1 > UINT16_MAX)
+    {
+        t->config.tier1 = UINT16_MAX;
+    }
+    t->size = mem->size;
+    t->next_cold = config->cold;
+    n = mem->size + 1;
+    t->metadata = calloc(n, sizeof(block_t *) + sizeof(uint16_t) + 3);
+    if (t->metadata == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    t->blocks = t->metadata;
+    t->entries = (uint16_t *) (t->blocks + n);
+    t->smc = (unsigned char *) (t->entries + n);
+    mem->code = t->smc + n;
+    t->uncached = mem->code + n;
+    mem->code_write = -1;
+#if defined(__x86_64__)
+    if (config->tier2 > 0)
+    {
+        t->arena = mmap(NULL, NATIVE_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (t->arena == MAP_FAILED)
+        {
+            t->arena = NULL;
+        }
+    }
+#endif
+    if (t->arena != NULL)
+    {
+        open_profiler_maps(t);
+    }
+    return t;
+}
+
+void free_trace(tiers_t *t, memory_t *mem, trace_t *r);
+
+void free_tiers(tiers_t *t, memory_t *mem)
+{
+    int i;
+    while (t->traces != NULL)
+    {
+        free_trace(t, mem, t->traces);
+    }
+    free(t->recording);
+    for (i = 0; i < t->size; i++)
+    {
+        free(t->blocks[i]);
+    }
+    if (t->arena != NULL)
+    {
+        munmap(t->arena, NATIVE_ARENA_SIZE);
+    }
+    close_profiler_maps(t);
+    free(t->metadata);
+    mem->code = NULL;
+    free(t);
+}
+
+/* Forgets every block, for when memory is replaced underneath them */
+void reset_tiers(tiers_t *t, memory_t *mem)
+{
+    int i;
+    while (t->traces != NULL)
+    {
+        free_trace(t, mem, t->traces);
+    }
+    free(t->recording);
+    t->recording = NULL;
+    for (i = 0; i < t->size; i++)
+    {
+        free(t->blocks[i]);
+    }
+    memset(t->metadata, 0, (t->size + 1) * (sizeof(block_t *) + sizeof(uint16_t) + 3));
+    mem->code_write = -1;
+    t->arena_used = 0;
+    t->next_cold = 0;
+}
+
+int decodable(int word, int extended)
+{
+    return word >= 0 && get_opcode(word) < (extended ? NUM_EXT_OPCODES : NUM_OPCODES);
+}
+
+int ends_block(enum opcode_t op)
+{
+    return op == JMP || op == JGE || op == JNE || op == STP;
+}
+
+/* Blocks and traces are only given a budget of two cycles an instruction,
+ * so anything that may reach the arithmetic unit and stall is left to the
+ * interpreter, which checks the limit after every cycle */
+int uses_arith(memory_t *mem, int word)
+{
+    switch (get_opcode(word))
+    {
+        case LDA:
+        case STO:
+        case ADD:
+        case SUB:
+        case AND:
+            return is_arith(mem, get_operand(word));
+        case LDN:
+        case STN:
+            return mem->arith.latency >= 0;
+        default:
+            return 0;
+    }
+}
+
+/* Returns NULL if there is nothing at start worth caching */
+block_t *build_block(memory_t *mem, int start, int extended)
+{
+    block_t *b;
+    insn_t *in;
+    int addr;
+    int word;
+
+    b = malloc(sizeof(block_t));
+    if (b == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    b->start = start;
+    b->length = 0;
+    b->tier = PREDECODED;
+    b->runs = 0;
+    b->recent = 0;
+    b->native = NULL;
+    b->native_size = 0;
+    b->trace = NULL;
+    for (addr = start; addr < mem->size && addr != IO_ADDRESS && b->length < MAX_BLOCK_LENGTH; addr++)
+    {
+        word = mem->data[addr];
+        if (!decodable(word, extended) || uses_arith(mem, word))
+        {
+            break;
+        }
+        in = &b->insns[b->length++];
+        in->op = get_opcode(word);
+        in->operand = get_operand(word);
+        in->word = word;
+        in->direct = in->operand != IO_ADDRESS && in->operand != LOCK_ADDRESS
+            && in->operand <= mem->size;
+        if (ends_block(in->op))
+        {
+            break;
+        }
+    }
+    if (b->length == 0)
+    {
+        free(b);
+        return NULL;
+    }
+    for (addr = start; addr < start + b->length; addr++)
+    {
+        mem->code[addr]++;
+    }
+    return b;
+}
+
+void drop_block(tiers_t *t, memory_t *mem, block_t *b)
+{
+    int addr;
+    for (addr = b->start; addr < b->start + b->length; addr++)
+    {
+        mem->code[addr]--;
+    }
+    if (b->trace != NULL)
+    {
+        free_trace(t, mem, b->trace);
+    }
+    t->blocks[b->start] = NULL;
+    t->entries[b->start] = 0;
+    /* native code is left in the arena, it is only reclaimed with the arena */
+    free(b);
+}
+
+void free_trace(tiers_t *t, memory_t *mem, trace_t *r)
+{
+    trace_t **p;
+    int i;
+    for (p = &t->traces; *p != r; p = &(*p)->next)
+    {
+    }
+    *p = r->next;
+    for (i = 0; i < r->length; i++)
+    {
+        mem->code[r->addresses[i]]--;
+    }
+    if (t->blocks[r->head] != NULL)
+    {
+        t->blocks[r->head]->trace = NULL;
+    }
+    free(r);
+}
+
+/* A store landed on cached code, so drop every block covering it */
+void code_written(tiers_t *t, memory_t *mem, int address)
+{
+    trace_t **p;
+    int start;
+    block_t *b;
+    int i;
+    if (t->uncached[address])
+    {
+        t->uncached[address] = 0;
+        mem->code[address]--;
+    }
+    for (start = address - MAX_BLOCK_LENGTH + 1; start <= address; start++)
+    {
+        if (start < 0 || (b = t->blocks[start]) == NULL || start + b->length <= address)
+        {
+            continue;
+        }
+        if (t->smc[start] < SMC_LIMIT)
+        {
+            t->smc[start]++;
+        }
+        drop_block(t, mem, b);
+        t->stats.self_modified++;
+    }
+    for (p = &t->traces; *p != NULL; )
+    {
+        for (i = 0; i < (*p)->length && (*p)->addresses[i] != address; i++)
+        {
+        }
+        if (i < (*p)->length)
+        {
+            free_trace(t, mem, *p);
+        }
+        else
+        {
+            p = &(*p)->next;
+        }
+    }
+    mem->code_write = -1;
+}
+
+/* Drops the blocks that have not run since the last call */
+void drop_cold_blocks(tiers_t *t, memory_t *mem)
+{
+    int i;
+    for (i = 0; i < t->size; i++)
+    {
+        if (t->blocks[i] != NULL)
+        {
+            if (t->blocks[i]->recent == 0)
+            {
+                drop_block(t, mem, t->blocks[i]);
+                t->stats.cold++;
+            }
+            else
+            {
+                t->blocks[i]->recent = 0;
+            }
+        }
+    }
+}
+
+/* Runs a predecoded block as if each instruction had been fetched. Returns
+ * 1 if it ended in a taken jump, leaving the target in PC to be fetched. */
+int run_block(block_t *b, cpu_t *cpu, memory_t *mem)
+{
+    insn_t *in;
+    int i;
+    for (i = 0; i < b->length; i++)
+    {
+        in = &b->insns[i];
+        cpu->steps += 2;
+        cpu->IR = in->word;
+        switch (in->op)
+        {
+            case LDA:
+                cpu->ACC = in->direct ? (int16_t) mem->data[in->operand] : load(mem, in->operand);
+                break;
+            case STO:
+                if (in->direct)
+                {
+                    mem->data[in->operand] = cpu->ACC;
+                    if (mem->code[in->operand])
+                    {
+                        mem->code_write = in->operand;
+                    }
+                }
+                else
+                {
+                    set(mem, in->operand, cpu->ACC);
+                }
+                break;
+            case ADD:
+                cpu->ACC = (int16_t) (cpu->ACC
+                    + (in->direct ? (int16_t) mem->data[in->operand] : load(mem, in->operand)));
+                break;
+            case SUB:
+                cpu->ACC = (int16_t) (cpu->ACC
+                    - (in->direct ? (int16_t) mem->data[in->operand] : load(mem, in->operand)));
+                break;
+            case JMP:
+                cpu->PC = in->operand;
+                return 1;
+            case JGE:
+                if (cpu->ACC >= 0)
+                {
+                    cpu->PC = in->operand;
+                    return 1;
+                }
+                break;
+            case JNE:
+                if (cpu->ACC != 0)
+                {
+                    cpu->PC = in->operand;
+                    return 1;
+                }
+                break;
+            case STP:
+                cpu->PC = b->start + i + 1;
+                cpu->state = EXECUTE;
+                cpu->done = 1;
+                return 0;
+            case LDI:
+                cpu->ACC = in->operand;
+                break;
+            case LDN:
+                cpu->ACC = load(mem, get_operand(get(mem, in->operand)));
+                break;
+            case STN:
+                set(mem, get_operand(get(mem, in->operand)), cpu->ACC);
+                break;
+            case SHL:
+                cpu->ACC = (int16_t) ((unsigned int) cpu->ACC << (in->operand & 0x1f));
+                break;
+            case SHR:
+                cpu->ACC >>= in->operand & 0x1f;
+                break;
+            case AND:
+                cpu->ACC &= in->direct ? (int16_t) mem->data[in->operand] : load(mem, in->operand);
+                break;
+        }
+        if (mem->code_write >= 0)
+        {
+            i++;
+            break;
+        }
+    }
+    cpu->PC = b->start + i;
+    cpu->state = FETCH;
+    return 0;
+}
+
+/* ------------------------------------------- */
+/* --------------- NATIVE CODE --------------- */
+/* ------------------------------------------- */
+
+#if defined(__x86_64__)
+
+/* Generated code keeps the cpu in rbx, the memory in r13, its data in r12,
+ * the code map in r15 and the accumulator in r14d. Traces also keep their
+ * iterations left in ebp and cells in the registers below. */
+
+static const int trace_registers[TRACE_REGISTERS] = {1, 2, 6, 7, 8, 9, 10, 11};
+
+typedef struct {
+    unsigned char *p;
+    int steps;   /* cycles since steps was last written back */
+    trace_t *trace;  /* the trace being compiled, or NULL for a block */
+} emitter_t;
+
+void emit_bytes(emitter_t *e, const char *bytes, int n)
+{
+    memcpy(e->p, bytes, n);
+    e->p += n;
+}
+
+void emit_u8(emitter_t *e, int x)
+{
+    *e->p++ = x;
+}
+
+void emit_u32(emitter_t *e, unsigned int x)
+{
+    memcpy(e->p, &x, 4);
+    e->p += 4;
+}
+
+void emit_u64(emitter_t *e, unsigned long x)
+{
+    memcpy(e->p, &x, 8);
+    e->p += 8;
+}
+
+/* movsx eax, word [r12 + address * 2]; then op r14d, eax for mov (89),
+ * add (01), sub (29), and (21) */
+void emit_acc_mem(emitter_t *e, int opcode, int address)
+{
+    emit_bytes(e, "\x41\x0f\xbf\x84\x24", 5);
+    emit_u32(e, address * 2);
+    emit_u8(e, 0x41);
+    emit_u8(e, opcode);
+    emit_u8(e, 0xc6);
+}
+
+/* op r14d, reg for mov (89), add (01), sub (29), and (21) */
+void emit_acc_register(emitter_t *e, int opcode, int reg)
+{
+    emit_u8(e, reg >= 8 ? 0x45 : 0x41);
+    emit_u8(e, opcode);
+    emit_u8(e, 0xc6 | (reg & 7) << 3);
+}
+
+/* movsx r14d, r14w, as the accumulator is 16 bits */
+void emit_wrap_acc(emitter_t *e)
+{
+    emit_bytes(e, "\x45\x0f\xbf\xf6", 4);
+}
+
+/* movsx reg, word [r12 + address * 2] */
+void emit_cell_load(emitter_t *e, int reg, int address)
+{
+    emit_u8(e, reg >= 8 ? 0x45 : 0x41);
+    emit_bytes(e, "\x0f\xbf", 2);
+    emit_u8(e, 0x84 | (reg & 7) << 3);
+    emit_u8(e, 0x24);
+    emit_u32(e, address * 2);
+}
+
+/* Stores the cells the trace has written from their registers */
+void emit_write_back(emitter_t *e)
+{
+    int i;
+    for (i = 0; i < TRACE_REGISTERS; i++)
+    {
+        if (e->trace->written[i])
+        {
+            /* mov [r12 + cell * 2], reg16 */
+            emit_u8(e, 0x66);
+            emit_u8(e, trace_registers[i] >= 8 ? 0x45 : 0x41);
+            emit_u8(e, 0x89);
+            emit_u8(e, 0x84 | (trace_registers[i] & 7) << 3);
+            emit_u8(e, 0x24);
+            emit_u32(e, e->trace->cells[i] * 2);
+        }
+    }
+}
+
+/* Loads every cell the trace keeps in a register */
+void emit_reload(emitter_t *e)
+{
+    int i;
+    for (i = 0; i < TRACE_REGISTERS; i++)
+    {
+        if (e->trace->cells[i] >= 0)
+        {
+            emit_cell_load(e, trace_registers[i], e->trace->cells[i]);
+        }
+    }
+}
+
+/* mov dword [rbx + offset], value */
+void emit_cpu_store(emitter_t *e, int offset, int value)
+{
+    emit_bytes(e, "\xc7\x83", 2);
+    emit_u32(e, offset);
+    emit_u32(e, value);
+}
+
+void emit_sync_steps(emitter_t *e)
+{
+    if (e->steps > 0)
+    {
+        /* add dword [rbx + steps], n */
+        emit_bytes(e, "\x81\x83", 2);
+        emit_u32(e, offsetof(cpu_t, steps));
+        emit_u32(e, e->steps);
+        e->steps = 0;
+    }
+}
+
+/* Calls fn(mem, address, acc), leaving the result in eax */
+void emit_call(emitter_t *e, void *fn, int address)
+{
+    emit_sync_steps(e);
+    if (e->trace != NULL)
+    {
+        /* the callee may read them, and the call clobbers their registers */
+        emit_write_back(e);
+    }
+    /* mov [rbx + ACC], r14d */
+    emit_bytes(e, "\x44\x89\xb3", 3);
+    emit_u32(e, offsetof(cpu_t, ACC));
+    /* mov rdi, r13; mov esi, address; mov edx, r14d */
+    emit_bytes(e, "\x4c\x89\xef\xbe", 4);
+    emit_u32(e, address);
+    emit_bytes(e, "\x44\x89\xf2", 3);
+    /* mov rax, fn; call rax */
+    emit_bytes(e, "\x48\xb8", 2);
+    emit_u64(e, (unsigned long) fn);
+    emit_bytes(e, "\xff\xd0", 2);
+}
+
+void emit_return(emitter_t *e, int ret)
+{
+    /* mov eax, ret */
+    emit_u8(e, 0xb8);
+    emit_u32(e, ret);
+    if (e->trace != NULL)
+    {
+        /* add rsp, 8 */
+        emit_bytes(e, "\x48\x83\xc4\x08", 4);
+    }
+    /* pop r15, r14, r13, r12, rbx */
+    emit_bytes(e, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b", 9);
+    if (e->trace != NULL)
+    {
+        /* pop rbp */
+        emit_u8(e, 0x5d);
+    }
+    emit_u8(e, 0xc3);
+}
+
+/* Writes back the cpu and returns ret */
+void emit_exit(emitter_t *e, int pc, int word, int done, int ret)
+{
+    int steps = e->steps;
+    emit_sync_steps(e);
+    e->steps = steps;
+    emit_cpu_store(e, offsetof(cpu_t, PC), pc);
+    emit_cpu_store(e, offsetof(cpu_t, IR), word);
+    emit_cpu_store(e, offsetof(cpu_t, state), done ? EXECUTE : FETCH);
+    if (done)
+    {
+        emit_cpu_store(e, offsetof(cpu_t, done), 1);
+    }
+    /* mov [rbx + ACC], r14d */
+    emit_bytes(e, "\x44\x89\xb3", 3);
+    emit_u32(e, offsetof(cpu_t, ACC));
+    if (e->trace != NULL)
+    {
+        emit_write_back(e);
+    }
+    emit_return(e, ret);
+}
+
+/* Leaves the block if the last store landed on cached code */
+void emit_code_write_check(emitter_t *e, int pc, int word)
+{
+    unsigned char *skip;
+    /* cmp dword [r13 + code_write], -1; je skip */
+    emit_bytes(e, "\x41\x83\xbd", 3);
+    emit_u32(e, offsetof(memory_t, code_write));
+    emit_bytes(e, "\xff\x0f\x84", 3);
+    skip = e->p;
+    emit_u32(e, 0);
+    emit_exit(e, pc, word, 0, 0);
+    *(int *) skip = e->p - (skip + 4);
+}
+
+int indirect_get(memory_t *mem, int address)
+{
+    return load(mem, get_operand(get(mem, address)));
+}
+
+void indirect_set(memory_t *mem, int address, int value)
+{
+    set(mem, get_operand(get(mem, address)), value);
+}
+
+int direct_get(memory_t *mem, int address)
+{
+    return load(mem, address);
+}
+
+void compile_block(tiers_t *t, block_t *b)
+{
+    emitter_t e;
+    insn_t *in;
+    unsigned char *code;
+    unsigned char *skip;
+    int addr;
+    int i;
+
+    if (t->arena == NULL || t->arena_used + NATIVE_BLOCK_MAX > NATIVE_ARENA_SIZE)
+    {
+        return;
+    }
+    code = t->arena + t->arena_used;
+    e.p = code;
+    e.steps = 0;
+    e.trace = NULL;
+    /* push rbx, r12, r13, r14, r15 */
+    emit_bytes(&e, "\x53\x41\x54\x41\x55\x41\x56\x41\x57", 9);
+    /* mov rbx, rdi; mov r13, rsi */
+    emit_bytes(&e, "\x48\x89\xfb\x49\x89\xf5", 6);
+    /* mov r12, [rsi + data]; mov r15, [rsi + code]; mov r14d, [rbx + ACC] */
+    emit_bytes(&e, "\x4c\x8b\xa6", 3);
+    emit_u32(&e, offsetof(memory_t, data));
+    emit_bytes(&e, "\x4c\x8b\xbe", 3);
+    emit_u32(&e, offsetof(memory_t, code));
+    emit_bytes(&e, "\x44\x8b\xb3", 3);
+    emit_u32(&e, offsetof(cpu_t, ACC));
+
+    for (i = 0; i < b->length; i++)
+    {
+        in = &b->insns[i];
+        addr = b->start + i;
+        e.steps += 2;
+        switch (in->op)
+        {
+            case LDA:
+            case ADD:
+            case SUB:
+            case AND:
+                if (in->direct)
+                {
+                    emit_acc_mem(&e, in->op == LDA ? 0x89 : in->op == ADD ? 0x01 : in->op == SUB ? 0x29 : 0x21,
+                        in->operand);
+                }
+                else
+                {
+                    emit_call(&e, direct_get, in->operand);
+                    /* mov, add, sub or and r14d, eax */
+                    emit_u8(&e, 0x41);
+                    emit_u8(&e, in->op == LDA ? 0x89 : in->op == ADD ? 0x01 : in->op == SUB ? 0x29 : 0x21);
+                    emit_u8(&e, 0xc6);
+                }
+                if (in->op == ADD || in->op == SUB)
+                {
+                    emit_wrap_acc(&e);
+                }
+                break;
+            case STO:
+                if (in->direct)
+                {
+                    /* mov [r12 + operand * 2], r14w */
+                    emit_bytes(&e, "\x66\x45\x89\xb4\x24", 5);
+                    emit_u32(&e, in->operand * 2);
+                    /* cmp byte [r15 + operand], 0; je skip */
+                    emit_bytes(&e, "\x41\x80\xbf", 3);
+                    emit_u32(&e, in->operand);
+                    emit_bytes(&e, "\x00\x0f\x84", 3);
+                    skip = e.p;
+                    emit_u32(&e, 0);
+                    /* mov dword [r13 + code_write], operand */
+                    emit_bytes(&e, "\x41\xc7\x85", 3);
+                    emit_u32(&e, offsetof(memory_t, code_write));
+                    emit_u32(&e, in->operand);
+                    emit_exit(&e, addr + 1, in->word, 0, 0);
+                    *(int *) skip = e.p - (skip + 4);
+                }
+                else
+                {
+                    emit_call(&e, set, in->operand);
+                    emit_code_write_check(&e, addr + 1, in->word);
+                }
+                break;
+            case JMP:
+                emit_exit(&e, in->operand, in->word, 0, 1);
+                break;
+            case JGE:
+            case JNE:
+                /* test r14d, r14d; js/jz skip */
+                emit_bytes(&e, "\x45\x85\xf6\x0f", 4);
+                emit_u8(&e, in->op == JGE ? 0x88 : 0x84);
+                skip = e.p;
+                emit_u32(&e, 0);
+                emit_exit(&e, in->operand, in->word, 0, 1);
+                *(int *) skip = e.p - (skip + 4);
+                break;
+            case STP:
+                emit_exit(&e, addr + 1, in->word, 1, 0);
+                break;
+            case LDI:
+                /* mov r14d, operand */
+                emit_bytes(&e, "\x41\xbe", 2);
+                emit_u32(&e, in->operand);
+                break;
+            case LDN:
+                emit_call(&e, indirect_get, in->operand);
+                /* mov r14d, eax */
+                emit_bytes(&e, "\x41\x89\xc6", 3);
+                break;
+            case STN:
+                emit_call(&e, indirect_set, in->operand);
+                emit_code_write_check(&e, addr + 1, in->word);
+                break;
+            case SHL:
+            case SHR:
+                /* shl/sar r14d, n */
+                emit_bytes(&e, "\x41\xc1", 2);
+                emit_u8(&e, in->op == SHL ? 0xe6 : 0xfe);
+                emit_u8(&e, in->operand & 0x1f);
+                if (in->op == SHL)
+                {
+                    emit_wrap_acc(&e);
+                }
+                break;
+        }
+    }
+    if (b->insns[b->length - 1].op != STP && b->insns[b->length - 1].op != JMP)
+    {
+        /* fell off the end, or a conditional jump was not taken */
+        emit_exit(&e, b->start + b->length, b->insns[b->length - 1].word, 0, 0);
+    }
+    b->native = (native_fn) code;
+    b->native_size = e.p - code;
+    b->tier = NATIVE;
+    t->arena_used += (b->native_size + 15) & ~15;
+    t->stats.native++;
+    publish_code(t, "mu0", b->start, (void *) b->native, b->native_size);
+}
+
+/* Returns the register keeping a cell in the trace, or -1 */
+int cell_register(trace_t *r, insn_t *in)
+{
+    int i;
+    for (i = 0; in->direct && i < TRACE_REGISTERS; i++)
+    {
+        if (r->cells[i] == in->operand)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Keeps the cells the trace uses most in registers, leaving out any that
+ * hold code */
+void choose_cells(trace_t *r, memory_t *mem)
+{
+    int counts[TRACE_MAX_LENGTH];
+    int i;
+    int j;
+    int best;
+    for (i = 0; i < TRACE_MAX_LENGTH; i++)
+    {
+        counts[i] = 0;
+    }
+    for (i = 0; i < r->length; i++)
+    {
+        for (j = 0; j <= i; j++)
+        {
+            if (r->insns[j].direct && r->insns[j].operand == r->insns[i].operand)
+            {
+                break;
+            }
+        }
+        if (j <= i && r->insns[i].op != LDN && r->insns[i].op != STN && r->insns[i].op != LDI
+            && r->insns[i].op != SHL && r->insns[i].op != SHR && !ends_block(r->insns[i].op)
+            && !mem->code[r->insns[i].operand])
+        {
+            counts[j]++;
+        }
+    }
+    for (i = 0; i < TRACE_REGISTERS; i++)
+    {
+        for (best = -1, j = 0; j < r->length; j++)
+        {
+            if (counts[j] > 0 && (best < 0 || counts[j] > counts[best]))
+            {
+                best = j;
+            }
+        }
+        r->cells[i] = best < 0 ? -1 : r->insns[best].operand;
+        r->written[i] = 0;
+        if (best >= 0)
+        {
+            counts[best] = 0;
+        }
+    }
+    for (i = 0; i < r->length; i++)
+    {
+        j = cell_register(r, &r->insns[i]);
+        if (j >= 0 && r->insns[i].op == STO)
+        {
+            r->written[j] = 1;
+        }
+    }
+}
+
+/* Leaves the trace at a jump that goes the other way from when it was
+ * recorded. jcc skips the exit when it goes the same way. */
+void emit_side_exit(emitter_t *e, int jcc, int pc, int word, int ret)
+{
+    unsigned char *skip;
+    /* test r14d, r14d; jcc skip */
+    emit_bytes(e, "\x45\x85\xf6\x0f", 4);
+    emit_u8(e, jcc);
+    skip = e->p;
+    emit_u32(e, 0);
+    emit_exit(e, pc, word, 0, ret);
+    *(int *) skip = e->p - (skip + 4);
+}
+
+/* Compiles a trace that went round from its head back to it. The native
+ * code goes round up to the given number of times, keeping the chosen cells
+ * in registers, and returns -1 without running if a stored cell is code. */
+void compile_trace(tiers_t *t, memory_t *mem, trace_t *r)
+{
+    emitter_t e;
+    insn_t *in;
+    unsigned char *code;
+    unsigned char *loop;
+    unsigned char *skip;
+    unsigned char *bail[TRACE_REGISTERS];
+    int bails = 0;
+    int last_taken;
+    int addr;
+    int reg;
+    int i;
+
+    if (t->arena == NULL || t->arena_used + NATIVE_TRACE_MAX > NATIVE_ARENA_SIZE)
+    {
+        free(r);
+        return;
+    }
+    choose_cells(r, mem);
+    code = t->arena + t->arena_used;
+    e.p = code;
+    e.steps = 0;
+    e.trace = r;
+    /* push rbp, rbx, r12, r13, r14, r15; sub rsp, 8 */
+    emit_bytes(&e, "\x55\x53\x41\x54\x41\x55\x41\x56\x41\x57\x48\x83\xec\x08", 14);
+    /* mov rbx, rdi; mov r13, rsi; mov ebp, edx */
+    emit_bytes(&e, "\x48\x89\xfb\x49\x89\xf5\x89\xd5", 8);
+    /* mov r12, [rsi + data]; mov r15, [rsi + code]; mov r14d, [rbx + ACC] */
+    emit_bytes(&e, "\x4c\x8b\xa6", 3);
+    emit_u32(&e, offsetof(memory_t, data));
+    emit_bytes(&e, "\x4c\x8b\xbe", 3);
+    emit_u32(&e, offsetof(memory_t, code));
+    emit_bytes(&e, "\x44\x8b\xb3", 3);
+    emit_u32(&e, offsetof(cpu_t, ACC));
+    /* stores to a cell that has since become code must be seen */
+    for (i = 0; i < TRACE_REGISTERS; i++)
+    {
+        if (r->written[i])
+        {
+            /* cmp byte [r15 + cell], 0; jne bail */
+            emit_bytes(&e, "\x41\x80\xbf", 3);
+            emit_u32(&e, r->cells[i]);
+            emit_bytes(&e, "\x00\x0f\x85", 3);
+            bail[bails++] = e.p;
+            emit_u32(&e, 0);
+        }
+    }
+    emit_reload(&e);
+    loop = e.p;
+
+    for (i = 0; i < r->length; i++)
+    {
+        in = &r->insns[i];
+        addr = r->addresses[i];
+        reg = cell_register(r, in);
+        e.steps += 2;
+        switch (in->op)
+        {
+            case LDA:
+            case ADD:
+            case SUB:
+            case AND:
+                if (reg >= 0)
+                {
+                    emit_acc_register(&e, in->op == LDA ? 0x89 : in->op == ADD ? 0x01
+                        : in->op == SUB ? 0x29 : 0x21, trace_registers[reg]);
+                }
+                else if (in->direct)
+                {
+                    emit_acc_mem(&e, in->op == LDA ? 0x89 : in->op == ADD ? 0x01 : in->op == SUB ? 0x29 : 0x21,
+                        in->operand);
+                }
+                else
+                {
+                    emit_call(&e, direct_get, in->operand);
+                    emit_u8(&e, 0x41);
+                    emit_u8(&e, in->op == LDA ? 0x89 : in->op == ADD ? 0x01 : in->op == SUB ? 0x29 : 0x21);
+                    emit_u8(&e, 0xc6);
+                    emit_reload(&e);
+                }
+                if (in->op == ADD || in->op == SUB)
+                {
+                    emit_wrap_acc(&e);
+                }
+                break;
+            case STO:
+                if (reg >= 0)
+                {
+                    /* movsx reg, r14w */
+                    emit_u8(&e, trace_registers[reg] >= 8 ? 0x45 : 0x41);
+                    emit_bytes(&e, "\x0f\xbf", 2);
+                    emit_u8(&e, 0xc6 | (trace_registers[reg] & 7) << 3);
+                }
+                else if (in->direct)
+                {
+                    /* mov [r12 + operand * 2], r14w; cmp byte [r15 + operand], 0; je skip */
+                    emit_bytes(&e, "\x66\x45\x89\xb4\x24", 5);
+                    emit_u32(&e, in->operand * 2);
+                    emit_bytes(&e, "\x41\x80\xbf", 3);
+                    emit_u32(&e, in->operand);
+                    emit_bytes(&e, "\x00\x0f\x84", 3);
+                    skip = e.p;
+                    emit_u32(&e, 0);
+                    emit_bytes(&e, "\x41\xc7\x85", 3);
+                    emit_u32(&e, offsetof(memory_t, code_write));
+                    emit_u32(&e, in->operand);
+                    emit_exit(&e, addr + 1, in->word, 0, 0);
+                    *(int *) skip = e.p - (skip + 4);
+                }
+                else
+                {
+                    emit_call(&e, set, in->operand);
+                    emit_reload(&e);
+                    emit_code_write_check(&e, addr + 1, in->word);
+                }
+                break;
+            case JGE:
+            case JNE:
+                if (r->taken[i])
+                {
+                    /* jns or jnz past the exit */
+                    emit_side_exit(&e, in->op == JGE ? 0x89 : 0x85, addr + 1, in->word, 0);
+                }
+                else
+                {
+                    /* js or jz past the exit */
+                    emit_side_exit(&e, in->op == JGE ? 0x88 : 0x84, in->operand, in->word, 1);
+                }
+                break;
+            case LDI:
+                emit_bytes(&e, "\x41\xbe", 2);
+                emit_u32(&e, in->operand);
+                break;
+            case LDN:
+                emit_call(&e, indirect_get, in->operand);
+                emit_bytes(&e, "\x41\x89\xc6", 3);
+                emit_reload(&e);
+                break;
+            case STN:
+                emit_call(&e, indirect_set, in->operand);
+                emit_reload(&e);
+                emit_code_write_check(&e, addr + 1, in->word);
+                break;
+            case SHL:
+            case SHR:
+                emit_bytes(&e, "\x41\xc1", 2);
+                emit_u8(&e, in->op == SHL ? 0xe6 : 0xfe);
+                emit_u8(&e, in->operand & 0x1f);
+                if (in->op == SHL)
+                {
+                    emit_wrap_acc(&e);
+                }
+                break;
+            default:
+                /* JMP stays on the trace */
+                break;
+        }
+        if (r->taken[i] && i < r->length - 1)
+        {
+            /* the next block's first fetch came with the jump */
+            e.steps--;
+        }
+    }
+    /* back to the head, which a taken jump fetched, while iterations last */
+    last_taken = r->taken[r->length - 1];
+    e.steps -= last_taken;
+    emit_sync_steps(&e);
+    /* dec ebp; jnz loop */
+    emit_bytes(&e, "\xff\xcd\x0f\x85", 4);
+    emit_u32(&e, loop - (e.p + 4));
+    if (last_taken)
+    {
+        /* add dword [rbx + steps], 1, as the caller counts that fetch */
+        emit_bytes(&e, "\x83\x83", 2);
+        emit_u32(&e, offsetof(cpu_t, steps));
+        emit_u8(&e, 1);
+    }
+    emit_exit(&e, r->head, r->insns[r->length - 1].word, 0, last_taken);
+    for (i = 0; i < bails; i++)
+    {
+        *(int *) bail[i] = e.p - (bail[i] + 4);
+    }
+    emit_return(&e, -1);
+
+    r->native = (trace_fn) code;
+    r->native_size = e.p - code;
+    t->arena_used += (r->native_size + 15) & ~15;
+    publish_code(t, "mu0 trace", r->head, (void *) r->native, r->native_size);
+    for (i = 0; i < r->length; i++)
+    {
+        mem->code[r->addresses[i]]++;
+    }
+    r->next = t->traces;
+    t->traces = r;
+    t->blocks[r->head]->trace = r;
+    t->stats.traces++;
+}
+
+#else
+
+void compile_block(tiers_t *t, block_t *b)
+{
+    /* no native code generator for this host, stay predecoded */
+}
+
+void compile_trace(tiers_t *t, memory_t *mem, trace_t *r)
+{
+    free(r);
+}
+
+#endif
+
+void stop_trace(tiers_t *t)
+{
+    free(t->recording);
+    t->recording = NULL;
+}
+
+/* Adds a block that ran to the trace being recorded, and compiles the
+ * trace once it is back at its head. Any other way through is dropped. */
+void record_block(tiers_t *t, memory_t *mem, cpu_t *cpu, block_t *b, int taken)
+{
+    trace_t *r = t->recording;
+    int i;
+    if (mem->code_write >= 0 || cpu->done || r->length + b->length > TRACE_MAX_LENGTH)
+    {
+        stop_trace(t);
+        return;
+    }
+    for (i = 0; i < b->length; i++)
+    {
+        r->insns[r->length] = b->insns[i];
+        r->addresses[r->length] = b->start + i;
+        r->taken[r->length++] = taken && i == b->length - 1;
+    }
+    if (cpu->PC == r->head)
+    {
+        t->recording = NULL;
+        if (t->blocks[r->head] != NULL && t->blocks[r->head]->trace == NULL)
+        {
+            compile_trace(t, mem, r);
+        }
+        else
+        {
+            free(r);
+        }
+    }
+}
+
+/* Array loops that walk a table by storing over their own operands are
+ * dropped from the other tiers on every pass, so when the block at an
+ * address has been dropped that way its loop is matched against a few
+ * patterns and, if it is one, run to its end in one pass over the array
+ * with the memory, accumulator and cycle count it would have left. */
+
+#define IDIOM_MAX_LENGTH 10
+
+enum idiom_kind_t {
+    IDIOM_SUM,
+    IDIOM_COPY,
+    IDIOM_FILL,
+    IDIOM_SEARCH
+};
+
+typedef struct {
+    enum idiom_kind_t kind;
+    int length;
+    struct {
+        enum opcode_t op;
+        char operand;
+    } steps[IDIOM_MAX_LENGTH];
+} idiom_t;
+
+/* Operands 0 and 1 are the walkers, the instructions being stepped, p and
+ * q are their addresses and s is the start of the loop. Letters are cells:
+ * a the total, v the fill value, x the key, k the step and e the walker
+ * word that ends the loop. */
+static const idiom_t idioms[] = {
+    {IDIOM_SUM, 8, {{LDA, '0'}, {ADD, 'a'}, {STO, 'a'},
+        {LDA, 'p'}, {ADD, 'k'}, {STO, 'p'}, {SUB, 'e'}, {JNE, 's'}}},
+    {IDIOM_SUM, 8, {{LDA, 'a'}, {ADD, '0'}, {STO, 'a'},
+        {LDA, 'p'}, {ADD, 'k'}, {STO, 'p'}, {SUB, 'e'}, {JNE, 's'}}},
+    {IDIOM_COPY, 10, {{LDA, '0'}, {STO, '1'}, {LDA, 'p'}, {ADD, 'k'}, {STO, 'p'},
+        {LDA, 'q'}, {ADD, 'k'}, {STO, 'q'}, {SUB, 'e'}, {JNE, 's'}}},
+    {IDIOM_FILL, 7, {{LDA, 'v'}, {STO, '0'},
+        {LDA, 'p'}, {ADD, 'k'}, {STO, 'p'}, {SUB, 'e'}, {JNE, 's'}}},
+    {IDIOM_SEARCH, 6, {{LDA, 'p'}, {ADD, 'k'}, {STO, 'p'},
+        {LDA, '0'}, {SUB, 'x'}, {JNE, 's'}}}
+};
+
+#define NUM_IDIOMS (sizeof(idioms) / sizeof(idioms[0]))
+
+typedef struct {
+    const idiom_t *idiom;
+    int start;
+    int walkers[2];  /* addresses of the walkers */
+    int tested;      /* the walker compared with e */
+    int cells[26];   /* address of each letter, -1 if unused */
+} idiom_match_t;
+
+int idiom_cell(idiom_match_t *m, char letter)
+{
+    return m->cells[letter - 'a'];
+}
+
+/* Binds the operands of a pattern to the loop at start */
+int match_idiom(memory_t *mem, int start, const idiom_t *idiom, idiom_match_t *m)
+{
+    int i;
+    int c;
+    int word;
+    int operand;
+    if (start + idiom->length > (int) mem->size || start + idiom->length >= LOCK_ADDRESS)
+    {
+        return 0;
+    }
+    m->idiom = idiom;
+    m->start = start;
+    m->tested = 0;
+    for (i = 0; i < 26; i++)
+    {
+        m->cells[i] = -1;
+    }
+    for (i = 0; i < idiom->length; i++)
+    {
+        c = idiom->steps[i].operand;
+        if (c == '0' || c == '1')
+        {
+            m->walkers[c - '0'] = start + i;
+        }
+    }
+    for (i = 0; i < idiom->length; i++)
+    {
+        word = mem->data[start + i];
+        operand = get_operand(word);
+        c = idiom->steps[i].operand;
+        if (get_opcode(word) != idiom->steps[i].op)
+        {
+            return 0;
+        }
+        if (c == 'p' || c == 'q')
+        {
+            if (operand != m->walkers[c - 'p'])
+            {
+                return 0;
+            }
+            if (idiom->steps[i].op == STO)
+            {
+                m->tested = c - 'p';
+            }
+        }
+        else if (c == 's')
+        {
+            if (operand != start)
+            {
+                return 0;
+            }
+        }
+        else if (c != '0' && c != '1')
+        {
+            if ((m->cells[c - 'a'] >= 0 && m->cells[c - 'a'] != operand)
+                || operand > (int) mem->size || operand >= LOCK_ADDRESS || is_arith(mem, operand)
+                || (operand >= start && operand < start + idiom->length))
+            {
+                return 0;
+            }
+            m->cells[c - 'a'] = operand;
+        }
+    }
+    return 1;
+}
+
+/* Whether the n cells a walker visits from operand on are plain memory
+ * clear of the loop and its cells, and of any code if they are written */
+int idiom_clear(memory_t *mem, idiom_match_t *m, int operand, int n, int step, int written)
+{
+    int lo = step > 0 ? operand : operand + (n - 1) * step;
+    int hi = step > 0 ? operand + (n - 1) * step : operand;
+    int i;
+    if (lo < 0 || hi > (int) mem->size || hi >= LOCK_ADDRESS
+        || (mem->arith.latency >= 0 && hi >= ARITH_ADDRESS)
+        || (lo < m->start + m->idiom->length && hi >= m->start))
+    {
+        return 0;
+    }
+    for (i = 0; i < 26; i++)
+    {
+        if (m->cells[i] >= lo && m->cells[i] <= hi)
+        {
+            return 0;
+        }
+    }
+    for (i = lo; written && i <= hi; i++)
+    {
+        if (mem->code[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Runs the loop at start to its end if it is an array idiom that finishes
+ * within the limit, or returns 0 to leave it to the other tiers */
+int run_idiom(tiers_t *t, cpu_t *cpu, memory_t *mem, int start, int fetched, int limit)
+{
+    const idiom_t *idiom;
+    idiom_match_t m;
+    long cycles;
+    unsigned int total;
+    int step;
+    int end;
+    int src;
+    int dst;
+    int n;
+    int i;
+    for (idiom = idioms; idiom < idioms + NUM_IDIOMS && !match_idiom(mem, start, idiom, &m); idiom++)
+    {
+    }
+    if (idiom == idioms + NUM_IDIOMS)
+    {
+        return 0;
+    }
+    step = (int16_t) mem->data[idiom_cell(&m, 'k')];
+    if (step == 0)
+    {
+        return 0;
+    }
+    src = get_operand(mem->data[m.walkers[0]]);
+    if (idiom->kind == IDIOM_SEARCH)
+    {
+        /* the walker steps before it loads, so the search starts one on */
+        for (n = 1; idiom_clear(mem, &m, src + n * step, 1, step, 0); n++)
+        {
+            if (mem->data[src + n * step] == mem->data[idiom_cell(&m, 'x')])
+            {
+                break;
+            }
+        }
+        if (!idiom_clear(mem, &m, src + n * step, 1, step, 0))
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        /* the walkers keep their opcode, so the words count up evenly */
+        end = (int16_t) mem->data[idiom_cell(&m, 'e')];
+        n = (end - (int16_t) mem->data[m.walkers[m.tested]]) / step;
+        if (n < 1 || (int16_t) mem->data[m.walkers[m.tested]] + n * step != end)
+        {
+            return 0;
+        }
+        if (idiom->kind == IDIOM_SUM && (mem->code[idiom_cell(&m, 'a')]
+            || idiom_cell(&m, 'a') == idiom_cell(&m, 'k') || idiom_cell(&m, 'a') == idiom_cell(&m, 'e')))
+        {
+            return 0;
+        }
+        for (i = 0; i <= (idiom->kind == IDIOM_COPY); i++)
+        {
+            dst = get_operand(mem->data[m.walkers[i]]);
+            if (dst + n * step < 0 || dst + n * step > 0xfff
+                || !idiom_clear(mem, &m, dst, n, step, idiom->steps[m.walkers[i] - start].op == STO))
+            {
+                return 0;
+            }
+        }
+    }
+    /* the first pass saves the fetch if it was done, and every pass after
+     * it saves one as the jump back fetches its target */
+    cycles = 2L * idiom->length * n - (n - 1) - fetched;
+    if (limit > 0 && cpu->steps + cycles > limit)
+    {
+        return 0;
+    }
+    if (t->recording != NULL)
+    {
+        stop_trace(t);
+    }
+    switch (idiom->kind)
+    {
+        case IDIOM_SUM:
+            total = mem->data[idiom_cell(&m, 'a')];
+            for (i = 0; i < n; i++)
+            {
+                total += mem->data[src + i * step];
+            }
+            mem->data[idiom_cell(&m, 'a')] = total;
+            break;
+        case IDIOM_COPY:
+            dst = get_operand(mem->data[m.walkers[1]]);
+            if (step == 1 && (dst + n <= src || src + n <= dst))
+            {
+                memcpy(&mem->data[dst], &mem->data[src], n * sizeof(uint16_t));
+            }
+            else
+            {
+                /* in order, as overlapping copies repeat what they copied */
+                for (i = 0; i < n; i++)
+                {
+                    mem->data[dst + i * step] = mem->data[src + i * step];
+                }
+            }
+            break;
+        case IDIOM_FILL:
+            for (i = 0; i < n; i++)
+            {
+                mem->data[src + i * step] = mem->data[idiom_cell(&m, 'v')];
+            }
+            break;
+        case IDIOM_SEARCH:
+            break;
+    }
+    for (i = 0; i <= (idiom->kind == IDIOM_COPY); i++)
+    {
+        mem->data[m.walkers[i]] += n * step;
+        if (mem->code[m.walkers[i]])
+        {
+            code_written(t, mem, m.walkers[i]);
+        }
+    }
+    cpu->ACC = 0;
+    cpu->IR = mem->data[start + idiom->length - 1];
+    cpu->PC = start + idiom->length;
+    cpu->state = FETCH;
+    cpu->steps += cycles;
+    t->stats.idioms++;
+    return 1;
+}
+
+void run_verified(cpu_t *cpu, memory_t *mem, int limit, int one_block);
+
+/* Runs an instruction, or a block of them if one is hot enough. Code of a
+ * verified image that is not compiled yet runs in the verified engine
+ * instead, a block at a time. */
+void run_tiered(tiers_t *t, cpu_t *cpu, memory_t *mem, int extended, int limit)
+{
+    block_t *b;
+    int fetched = cpu->state == EXECUTE;
+    int start = fetched ? cpu->PC - 1 : cpu->PC;
+    int iterations;
+    int taken;
+    int steps;
+
+    if (start >= 0 && start < t->size)
+    {
+        if (t->smc[start] > 0 && t->config.idioms && run_idiom(t, cpu, mem, start, fetched, limit))
+        {
+            return;
+        }
+        b = t->blocks[start];
+        if (b == NULL && t->config.tier1 > 0 && t->smc[start] < SMC_LIMIT && !t->uncached[start]
+            && ++t->entries[start] >= t->config.tier1)
+        {
+            b = t->blocks[start] = build_block(mem, start, extended);
+            t->entries[start] = 0;
+            if (b != NULL)
+            {
+                t->stats.predecoded++;
+            }
+            else
+            {
+                /* nothing to cache, don't look again until the word
+                 * changes, which counting it as code will show */
+                t->uncached[start] = 1;
+                mem->code[start]++;
+            }
+        }
+        if (b != NULL && (limit <= 0 || cpu->steps + 2 * b->length - fetched <= limit))
+        {
+            b->runs++;
+            b->recent = 1;
+            taken = -1;
+            if (b->trace != NULL && t->recording == NULL)
+            {
+                iterations = limit <= 0 ? INT_MAX : (limit - cpu->steps) / (2 * b->trace->length);
+                if (iterations > 0)
+                {
+                    cpu->steps -= fetched;
+                    taken = b->trace->native(cpu, mem, iterations);
+                    cpu->steps += taken < 0 ? fetched : 0;
+                }
+            }
+            if (b->tier == PREDECODED && t->config.tier2 > 0 && b->runs >= t->config.tier2)
+            {
+                compile_block(t, b);
+            }
+            if (taken < 0 && b->tier == PREDECODED && mem->verified != NULL && t->recording == NULL)
+            {
+                /* the verified engine runs it without the block's checks */
+                steps = cpu->steps;
+                run_verified(cpu, mem, limit, 1);
+                if (cpu->steps != steps)
+                {
+                    return;
+                }
+            }
+            if (taken < 0)
+            {
+                if (b->tier == NATIVE && b->trace == NULL && t->recording == NULL
+                    && t->config.tier3 > 0 && b->runs % t->config.tier3 == 0)
+                {
+                    t->recording = calloc(1, sizeof(trace_t));
+                    if (t->recording == NULL)
+                    {
+                        fprintf(stderr, "Memory allocation error\n");
+                        exit(1);
+                    }
+                    t->recording->head = b->start;
+                }
+                cpu->steps -= fetched;
+                if (b->tier == NATIVE)
+                {
+                    taken = b->native(cpu, mem);
+                }
+                else
+                {
+                    taken = run_block(b, cpu, mem);
+                }
+                if (t->recording != NULL)
+                {
+                    record_block(t, mem, cpu, b, taken);
+                }
+            }
+            if (taken)
+            {
+                cpu->IR = get(mem, cpu->PC++);
+                cpu->state = EXECUTE;
+            }
+            if (mem->code_write >= 0)
+            {
+                code_written(t, mem, mem->code_write);
+            }
+            return;
+        }
+    }
+    /* interpret the instruction */
+    if (t->recording != NULL)
+    {
+        stop_trace(t);
+    }
+    if (mem->verified != NULL)
+    {
+        steps = cpu->steps;
+        run_verified(cpu, mem, limit, 1);
+        if (cpu->steps != steps)
+        {
+            return;
+        }
+    }
+    if (cpu->state == FETCH)
+    {
+        cpu->steps++;
+        cycle(cpu, mem, extended);
+    }
+    if (!cpu->done && within_limit(cpu, limit))
+    {
+        cpu->steps++;
+        cycle(cpu, mem, extended);
+    }
+    if (mem->code_write >= 0)
+    {
+        code_written(t, mem, mem->code_write);
+    }
+}
+
+void print_tier_stats(tier_stats_t *stats)
+{
+    fprintf(stderr, "Tier transitions:\n"
+        "    interpreted -> predecoded: %ld\n"
+        "    predecoded -> native: %ld\n"
+        "    native -> trace: %ld\n"
+        "    array loops run in one pass: %ld\n"
+        "    demoted for self-modifying code: %ld\n"
+        "    demoted as cold: %ld\n",
+        stats->predecoded, stats->native, stats->traces, stats->idioms, stats->self_modified, stats->cold);
+}
+
+/* Returns NULL when the plain interpreter should be used */
+tiers_t *start_tiers(memory_t *mem, int verbose, const tiering_t *tiering)
+{
+    if (verbose || tiering == NULL || tiering->tier1 <= 0)
+    {
+        return NULL;
+    }
+    return new_tiers(mem, tiering);
+}
+
+/* ------------------------------------------- */
+/* --------------- CO-SIMULATION ------------- */
+/* ------------------------------------------- */
+
+/* An RTL simulator of the mu0 core runs alongside the emulator and writes
+ * a record of its registers after every clock cycle into a ring in a
+ * shared file, which the emulator compares with its own cycle by cycle.
+ * The emulator creates the file and sets magic last. The simulator waits
+ * for magic, writes records at head, waits while the ring is full and
+ * stops when stop is set. Neither side makes a system call per cycle. */
+
+#define COSIM_MAGIC 0x6d753063
+#define COSIM_CAPACITY 65536
+#define COSIM_NO_WRITE 0xffff
+/* records read before tail is published to the simulator */
+#define COSIM_BATCH 64
+
+typedef struct {
+    uint32_t cycle;
+    uint16_t PC;
+    uint16_t ACC;
+    uint16_t IR;
+    /* address stored to during the cycle, or COSIM_NO_WRITE */
+    uint16_t write_address;
+    uint16_t write_value;
+    uint16_t unused;
+} cosim_record_t;
+
+/* head and tail are on their own cache lines so each side only pulls in
+ * the other's when it has to */
+typedef struct {
+    uint32_t magic;
+    uint32_t capacity;
+    uint32_t done;  /* set by the simulator when it has no more records */
+    uint32_t stop;  /* set by the emulator when it has finished comparing */
+    char pad0[48];
+    uint64_t head;  /* records written, by the simulator */
+    char pad1[56];
+    uint64_t tail;  /* records read, by the emulator */
+    char pad2[56];
+    cosim_record_t records[];
+} cosim_ring_t;
+
+typedef struct {
+    cosim_ring_t *ring;
+    size_t size;
+    uint64_t tail;
+    uint64_t head;
+} cosim_t;
+
+cosim_t *open_cosim(const char *name)
+{
+    cosim_t *c = calloc(1, sizeof(cosim_t));
+    int fd;
+    if (c == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    c->size = sizeof(cosim_ring_t) + COSIM_CAPACITY * sizeof(cosim_record_t);
+    fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, c->size) != 0)
+    {
+        fprintf(stderr, "Could not create %s\n", name);
+        exit(1);
+    }
+    c->ring = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (c->ring == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s\n", name);
+        exit(1);
+    }
+    c->ring->capacity = COSIM_CAPACITY;
+    __atomic_store_n(&c->ring->magic, COSIM_MAGIC, __ATOMIC_RELEASE);
+    return c;
+}
+
+void close_cosim(cosim_t *c)
+{
+    __atomic_store_n(&c->ring->tail, c->tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&c->ring->stop, 1, __ATOMIC_RELEASE);
+    munmap(c->ring, c->size);
+    free(c);
+}
+
+/* Copies the next record from the simulator out of the ring, before its
+ * slot can be handed back, and returns 0 if the simulator has stopped */
+int next_record(cosim_t *c, cosim_record_t *r)
+{
+    int spins = 0;
+    while (c->tail == c->head)
+    {
+        c->head = __atomic_load_n(&c->ring->head, __ATOMIC_ACQUIRE);
+        if (c->tail != c->head)
+        {
+            break;
+        }
+        /* let the simulator refill the ring */
+        __atomic_store_n(&c->ring->tail, c->tail, __ATOMIC_RELEASE);
+        if (__atomic_load_n(&c->ring->done, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&c->ring->head, __ATOMIC_ACQUIRE) == c->tail)
+        {
+            return 0;
+        }
+        if (++spins > 1000)
+        {
+            sched_yield();
+        }
+    }
+    *r = c->ring->records[c->tail % COSIM_CAPACITY];
+    if (++c->tail % COSIM_BATCH == 0)
+    {
+        __atomic_store_n(&c->ring->tail, c->tail, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+/* Returns the address the next cycle will store to, COSIM_NO_WRITE for
+ * none, or -1 if it can't be known beforehand because STN reads its
+ * pointer from IO_ADDRESS */
+int store_target(cpu_t *cpu, memory_t *mem, int extended)
+{
+    int operand = get_operand(cpu->IR);
+    if (cpu->state == FETCH || (!extended && get_opcode(cpu->IR) >= NUM_OPCODES))
+    {
+        return COSIM_NO_WRITE;
+    }
+    switch (get_opcode(cpu->IR))
+    {
+        case STO:
+            return operand;
+        case STN:
+            if (operand == IO_ADDRESS)
+            {
+                return -1;
+            }
+            /* an operand out of range faults before the store */
+            return operand <= mem->size ? get_operand(mem->data[operand]) : COSIM_NO_WRITE;
+        default:
+            return COSIM_NO_WRITE;
+    }
+}
+
+void print_record(const char *who, cosim_record_t *r)
+{
+    fprintf(stderr, "    %-8s %3u: PC = %04x, ACC = %04x, IR = %04x", who, r->cycle, r->PC, r->ACC, r->IR);
+    if (r->write_address != COSIM_NO_WRITE)
+    {
+        fprintf(stderr, ", [%03x] = %04x", r->write_address, r->write_value);
+    }
+    fprintf(stderr, "\n");
+}
+
+/* Runs one cycle at a time against the simulator's records, stopping at
+ * the first that differs */
+enum outcome_t run_cosim(cpu_t *cpu, memory_t *mem, int verbose, int extended, int limit, cosim_t *c)
+{
+    jmp_buf fault;
+    cosim_record_t expected;
+    cosim_record_t record;
+    int target;
+    mem->fault = &fault;
+    switch (setjmp(fault))
+    {
+        case FAULT:
+            mem->fault = NULL;
+            return FAULT;
+        case MISMATCH:
+            mem->fault = NULL;
+            return MISMATCH;
+    }
+    while (!cpu->done && within_limit(cpu, limit))
+    {
+        cpu->steps++;
+        if (verbose)
+        {
+            trace_cycle(cpu, -1);
+        }
+        target = store_target(cpu, mem, extended);
+        cycle(cpu, mem, extended);
+        if (!next_record(c, &record))
+        {
+            fprintf(stderr, "The simulator stopped before cycle %d\n", cpu->steps);
+            mem->fault = NULL;
+            return DIVERGED;
+        }
+        /* the core is 16 bits wide, so only the low bits of the
+         * accumulator are compared */
+        expected.cycle = cpu->steps;
+        expected.PC = cpu->PC;
+        expected.ACC = cpu->ACC;
+        expected.IR = cpu->IR;
+        expected.write_address = target < 0 ? record.write_address : target;
+        expected.write_value = expected.write_address == COSIM_NO_WRITE ? record.write_value : cpu->ACC;
+        if (record.cycle != expected.cycle || record.PC != expected.PC || record.ACC != expected.ACC
+            || record.IR != expected.IR || record.write_address != expected.write_address
+            || record.write_value != expected.write_value)
+        {
+            fprintf(stderr, "The simulator diverged on cycle %d:\n", cpu->steps);
+            print_record("emulator", &expected);
+            print_record("rtl", &record);
+            mem->fault = NULL;
+            return DIVERGED;
+        }
+    }
+    mem->fault = NULL;
+    return cpu->done ? STOPPED : LIMIT;
+}
+
+/* ------------------------------------------- */
+/* ---------------- WAVEFORMS ---------------- */
+/* ------------------------------------------- */
+
+/* The registers and the memory bus are recorded after every cycle, but
+ * only the signals that changed are written, into a large buffer that is
+ * flushed in one go. The compact format is a header and then a record per
+ * cycle with changes: the cycles since the last record as a varint, a
+ * byte with a bit per changed signal, and the new value of each changed
+ * signal wider than a bit as two bytes, little endian. A changed one bit
+ * signal has flipped, so needs no value. */
+
+#define WAVE_MAGIC "MU0WAVE1"
+#define WAVE_BUFFER (1 << 20)
+
+enum signal_t {
+    SIG_PC,
+    SIG_ACC,
+    SIG_IR,
+    SIG_STATE,
+    SIG_ADDRESS,
+    SIG_DATA,
+    SIG_READ,
+    SIG_WRITE,
+    NUM_SIGNALS
+};
+
+static const char *signal_names[NUM_SIGNALS] = {
+    "PC", "ACC", "IR", "state", "address", "data", "read", "write"
+};
+
+static const int signal_widths[NUM_SIGNALS] = {12, 16, 16, 1, 12, 16, 1, 1};
+
+typedef struct {
+    FILE *f;
+    int binary;
+    text_t buf;
+    unsigned int values[NUM_SIGNALS];
+    long time;  /* of the last record */
+} wave_t;
+
+void flush_wave(wave_t *w)
+{
+    fwrite(w->buf.data, 1, w->buf.size, w->f);
+    w->buf.size = 0;
+}
+
+void vcd_header(text_t *out)
+{
+    int i;
+    out->size += snprintf(text_reserve(out, 128), 128,
+        "$version mu0 $end\n$timescale 1ns $end\n$scope module mu0 $end\n");
+    for (i = 0; i < NUM_SIGNALS; i++)
+    {
+        out->size += snprintf(text_reserve(out, 64), 64, "$var wire %d %c %s $end\n",
+            signal_widths[i], '!' + i, signal_names[i]);
+    }
+    out->size += snprintf(text_reserve(out, 64), 64, "$upscope $end\n$enddefinitions $end\n");
+}
+
+void vcd_time(text_t *out, long time)
+{
+    char digits[24];
+    char *p = text_reserve(out, 32);
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + time % 10;
+        time /= 10;
+    } while (time > 0);
+    *p++ = '#';
+    while (n > 0)
+    {
+        *p++ = digits[--n];
+    }
+    *p++ = '\n';
+    out->size = p - out->data;
+}
+
+void vcd_value(text_t *out, int signal, unsigned int value)
+{
+    char *p = text_reserve(out, 24);
+    int bit;
+    if (signal_widths[signal] == 1)
+    {
+        *p++ = '0' + (value & 1);
+    }
+    else
+    {
+        *p++ = 'b';
+        for (bit = signal_widths[signal] - 1; bit > 0 && !(value >> bit & 1); bit--)
+        {
+        }
+        for (; bit >= 0; bit--)
+        {
+            *p++ = '0' + (value >> bit & 1);
+        }
+        *p++ = ' ';
+    }
+    *p++ = '!' + signal;
+    *p++ = '\n';
+    out->size = p - out->data;
+}
+
+wave_t *open_wave(const char *name, int binary)
+{
+    wave_t *w = calloc(1, sizeof(wave_t));
+    int i;
+    if (w == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    w->f = fopen(name, "wb");
+    if (w->f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", name);
+        exit(1);
+    }
+    w->binary = binary;
+    text_reserve(&w->buf, WAVE_BUFFER + 256);
+    if (binary)
+    {
+        memcpy(text_reserve(&w->buf, 8), WAVE_MAGIC, 8);
+        w->buf.size += 8;
+        return w;
+    }
+    /* everything starts at zero */
+    vcd_header(&w->buf);
+    vcd_time(&w->buf, 0);
+    for (i = 0; i < NUM_SIGNALS; i++)
+    {
+        vcd_value(&w->buf, i, 0);
+    }
+    return w;
+}
+
+void close_wave(wave_t *w)
+{
+    flush_wave(w);
+    fclose(w->f);
+    free(w->buf.data);
+    free(w);
+}
+
+/* Writes a record at time of the signals in values that changed */
+void record_wave(wave_t *w, long time, unsigned int *values)
+{
+    unsigned char *p;
+    unsigned char *mask;
+    unsigned long delta;
+    int i;
+    for (i = 0; i < NUM_SIGNALS && values[i] == w->values[i]; i++)
+    {
+    }
+    if (i == NUM_SIGNALS)
+    {
+        return;
+    }
+    if (!w->binary)
+    {
+        vcd_time(&w->buf, time);
+        for (; i < NUM_SIGNALS; i++)
+        {
+            if (values[i] != w->values[i])
+            {
+                vcd_value(&w->buf, i, values[i]);
+                w->values[i] = values[i];
+            }
+        }
+    }
+    else
+    {
+        p = (unsigned char *) text_reserve(&w->buf, 16 + 2 * NUM_SIGNALS);
+        for (delta = time - w->time; delta >= 0x80; delta >>= 7)
+        {
+            *p++ = delta | 0x80;
+        }
+        *p++ = delta;
+        mask = p++;
+        *mask = 0;
+        for (; i < NUM_SIGNALS; i++)
+        {
+            if (values[i] != w->values[i])
+            {
+                *mask |= 1 << i;
+                if (signal_widths[i] > 1)
+                {
+                    *p++ = values[i];
+                    *p++ = values[i] >> 8;
+                }
+                w->values[i] = values[i];
+            }
+        }
+        w->buf.size = (char *) p - w->buf.data;
+    }
+    w->time = time;
+    if (w->buf.size >= WAVE_BUFFER)
+    {
+        flush_wave(w);
+    }
+}
+
+/* Sets the bus signals for the cycle the cpu is about to run */
+void bus_access(cpu_t *cpu, memory_t *mem, int extended, unsigned int *values)
+{
+    int op = get_opcode(cpu->IR);
+    int operand = get_operand(cpu->IR);
+    int target;
+    values[SIG_READ] = 0;
+    values[SIG_WRITE] = 0;
+    if (cpu->state == FETCH)
+    {
+        values[SIG_ADDRESS] = cpu->PC;
+        values[SIG_READ] = 1;
+        return;
+    }
+    if (!extended && op >= NUM_OPCODES)
+    {
+        return;
+    }
+    switch (op)
+    {
+        case LDA:
+        case ADD:
+        case SUB:
+        case AND:
+        case JMP:
+            values[SIG_ADDRESS] = operand;
+            values[SIG_READ] = 1;
+            break;
+        case JGE:
+        case JNE:
+            if (op == JGE ? cpu->ACC >= 0 : cpu->ACC != 0)
+            {
+                values[SIG_ADDRESS] = operand;
+                values[SIG_READ] = 1;
+            }
+            break;
+        case LDN:
+            /* the second of its two reads */
+            if (operand != IO_ADDRESS && operand <= mem->size)
+            {
+                values[SIG_ADDRESS] = get_operand(mem->data[operand]);
+                values[SIG_READ] = 1;
+            }
+            break;
+        case STO:
+        case STN:
+            target = store_target(cpu, mem, extended);
+            if (target >= 0)
+            {
+                values[SIG_ADDRESS] = target;
+                values[SIG_WRITE] = 1;
+            }
+            break;
+    }
+}
+
+/* Runs one cycle at a time, recording the signals after each */
+enum outcome_t run_waves(cpu_t *cpu, memory_t *mem, int extended, int limit, wave_t *w)
+{
+    jmp_buf fault;
+    unsigned int values[NUM_SIGNALS];
+    int address;
+    mem->fault = &fault;
+    switch (setjmp(fault))
+    {
+        case FAULT:
+            mem->fault = NULL;
+            return FAULT;
+        case MISMATCH:
+            mem->fault = NULL;
+            return MISMATCH;
+    }
+    memcpy(values, w->values, sizeof(values));
+    while (!cpu->done && within_limit(cpu, limit))
+    {
+        cpu->steps++;
+        bus_access(cpu, mem, extended, values);
+        cycle(cpu, mem, extended);
+        address = values[SIG_ADDRESS];
+        if (values[SIG_WRITE])
+        {
+            values[SIG_DATA] = cpu->ACC & 0xffff;
+        }
+        else if (values[SIG_READ] && address != IO_ADDRESS && address <= mem->size)
+        {
+            values[SIG_DATA] = mem->data[address];
+        }
+        values[SIG_PC] = cpu->PC & 0xfff;
+        values[SIG_ACC] = cpu->ACC & 0xffff;
+        values[SIG_IR] = cpu->IR & 0xffff;
+        values[SIG_STATE] = cpu->state;
+        record_wave(w, cpu->steps, values);
+    }
+    mem->fault = NULL;
+    return cpu->done ? STOPPED : LIMIT;
+}
+
+/* Converts a wave file in the compact format to VCD. Returns non-zero if
+ * it is not one. */
+int wave_to_vcd(FILE *fin, FILE *fout)
+{
+    text_t out = {0};
+    unsigned int values[NUM_SIGNALS] = {0};
+    char magic[8];
+    unsigned long delta;
+    long time = 0;
+    int mask;
+    int shift;
+    int c;
+    int i;
+    if (fread(magic, 1, 8, fin) != 8 || memcmp(magic, WAVE_MAGIC, 8))
+    {
+        return 1;
+    }
+    vcd_header(&out);
+    vcd_time(&out, 0);
+    for (i = 0; i < NUM_SIGNALS; i++)
+    {
+        vcd_value(&out, i, 0);
+    }
+    while ((c = getc(fin)) != EOF)
+    {
+        delta = 0;
+        for (shift = 0; c & 0x80; shift += 7)
+        {
+            delta |= (unsigned long) (c & 0x7f) << shift;
+            c = getc(fin);
+        }
+        delta |= (unsigned long) c << shift;
+        time += delta;
+        mask = getc(fin);
+        vcd_time(&out, time);
+        for (i = 0; i < NUM_SIGNALS; i++)
+        {
+            if (mask >> i & 1)
+            {
+                if (signal_widths[i] > 1)
+                {
+                    values[i] = getc(fin);
+                    values[i] |= getc(fin) << 8;
+                }
+                else
+                {
+                    values[i] ^= 1;
+                }
+                vcd_value(&out, i, values[i]);
+            }
+        }
+        if (out.size >= WAVE_BUFFER)
+        {
+            fwrite(out.data, 1, out.size, fout);
+            out.size = 0;
+        }
+    }
+    fwrite(out.data, 1, out.size, fout);
+    free(out.data);
+    return 0;
+}
+
+/* ------------------------------------------- */
+/* --------------- RESULT CACHE -------------- */
+/* ------------------------------------------- */
+
+/* A run is fully determined by the image, the instruction set, the input
+ * and the cycle limit, so its result is kept in a file named after their
+ * hashes and returned the next time the same run is asked for. */
+
+#define FNV_OFFSET 0xcbf29ce484222325UL
+#define FNV_PRIME 0x100000001b3UL
+
+typedef struct {
+    const char *dir;
+    unsigned long image;
+    unsigned int image_size;
+    int extended;
+    int limit;
+} result_cache_t;
+
+typedef struct {
+    enum outcome_t outcome;
+    int fault_address;
+    int steps;
+    unsigned char *output;
+    size_t output_size;
+} result_t;
+
+unsigned long fnv_hash(unsigned long h, const unsigned char *p, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        h = (h ^ p[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+/* Must be made before anything runs, while memory still holds the image */
+result_cache_t *new_result_cache(const char *dir, memory_t *mem, int extended, int limit)
+{
+    result_cache_t *cache = malloc(sizeof(result_cache_t));
+    if (cache == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    mkdir(dir, 0777);
+    cache->dir = dir;
+    cache->image = fnv_hash(FNV_OFFSET, (const unsigned char *) mem->data,
+        mem->size * sizeof(uint16_t));
+    if (mem->arith.latency >= 0)
+    {
+        /* the latency changes the cycle counts */
+        cache->image = fnv_hash(cache->image, (const unsigned char *) &mem->arith.latency,
+            sizeof(int));
+    }
+    cache->image_size = mem->size;
+    cache->extended = extended;
+    cache->limit = limit;
+    return cache;
+}
+
+char *result_name(result_cache_t *cache, const unsigned char *input, size_t size)
+{
+    char *name = malloc(strlen(cache->dir) + 64);
+    if (name == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    sprintf(name, "%s/%016lx-%016lx-%d%s", cache->dir, cache->image,
+        fnv_hash(FNV_OFFSET, input, size), cache->limit, cache->extended ? "x" : "");
+    return name;
+}
+
+/* Returns 1 and fills result, whose output the caller frees, if this run
+ * has been done before */
+int find_result(result_cache_t *cache, const unsigned char *input, size_t size, result_t *result)
+{
+    char *name = result_name(cache, input, size);
+    FILE *f = fopen(name, "rb");
+    unsigned int image_size;
+    size_t input_size;
+    int outcome;
+    int found = 0;
+    free(name);
+    if (f == NULL)
+    {
+        return 0;
+    }
+    if (fscanf(f, "mu0 result %u %zu %d %d %d %zu\n", &image_size, &input_size, &outcome,
+            &result->fault_address, &result->steps, &result->output_size) == 6
+        && image_size == cache->image_size && input_size == size)
+    {
+        result->outcome = outcome;
+        result->output = malloc(result->output_size + 1);
+        if (result->output == NULL)
+        {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
+        found = fread(result->output, 1, result->output_size, f) == result->output_size;
+        if (!found)
+        {
+            free(result->output);
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+/* Written to a temporary file and renamed, so a run sharing the cache
+ * never sees half a result */
+void store_result(result_cache_t *cache, const unsigned char *input, size_t size, result_t *result)
+{
+    char *name = result_name(cache, input, size);
+    char *tmp = malloc(strlen(name) + 32);
+    FILE *f;
+    if (tmp == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    sprintf(tmp, "%s.%d", name, (int) getpid());
+    f = fopen(tmp, "wb");
+    if (f != NULL)
+    {
+        fprintf(f, "mu0 result %u %zu %d %d %d %zu\n", cache->image_size, size, result->outcome,
+            result->fault_address, result->steps, result->output_size);
+        fwrite(result->output, 1, result->output_size, f);
+        if (fclose(f) != 0 || rename(tmp, name) != 0)
+        {
+            remove(tmp);
+        }
+    }
+    free(tmp);
+    free(name);
+}
+
+/* ------------------------------------------- */
+/* ----------------- VERIFIER ---------------- */
+/* ------------------------------------------- */
+
+/* An image is verified if every instruction reachable from its entry
+ * address (0 unless a run is being resumed) only uses operands that are
+ * in range or IO_ADDRESS, and nothing stores over a reachable instruction.
+ * Such an image can't fault or change its own code, so it is decoded once
+ * and run without any checks. */
+
+enum vkind_t {
+    V_LDA,
+    V_LDA_IO,
+    V_STO,
+    V_STO_IO,
+    V_ADD,
+    V_ADD_IO,
+    V_SUB,
+    V_SUB_IO,
+    V_AND,
+    V_AND_IO,
+    V_JMP,
+    V_JGE,
+    V_JNE,
+    V_STP,
+    V_LDI,
+    V_SHL,
+    V_SHR,
+    V_UNREACHABLE
+};
+
+typedef struct vinsn_t {
+    enum vkind_t kind;
+    int operand;
+    int word;
+} vinsn_t;
+
+/* Returns the decoded program, or NULL if the image can't be verified */
+vinsn_t *verify(memory_t *mem, int extended, int entry)
+{
+    unsigned char *reached;
+    int *stack;
+    int top = 0;
+    int addr;
+    int operand;
+    int ok = 1;
+    vinsn_t *prog;
+    vinsn_t *in;
+
+    if (mem->size == 0)
+    {
+        return NULL;
+    }
+    reached = calloc(mem->size, 1);
+    stack = malloc((2 * mem->size + 2) * sizeof(int));
+    prog = malloc(mem->size * sizeof(vinsn_t));
+    if (reached == NULL || stack == NULL || prog == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    stack[top++] = entry;
+    while (ok && top > 0)
+    {
+        addr = stack[--top];
+        if (addr >= mem->size || addr == IO_ADDRESS || !decodable(mem->data[addr], extended))
+        {
+            ok = 0;
+            break;
+        }
+        if (reached[addr])
+        {
+            continue;
+        }
+        reached[addr] = 1;
+        operand = get_operand(mem->data[addr]);
+        switch (get_opcode(mem->data[addr]))
+        {
+            case LDA:
+            case STO:
+            case ADD:
+            case SUB:
+            case AND:
+                ok = operand == IO_ADDRESS || operand <= mem->size;
+                stack[top++] = addr + 1;
+                break;
+            case JGE:
+            case JNE:
+                stack[top++] = addr + 1;
+                stack[top++] = operand;
+                break;
+            case JMP:
+                stack[top++] = operand;
+                break;
+            case LDI:
+            case SHL:
+            case SHR:
+                stack[top++] = addr + 1;
+                break;
+            case LDN:
+            case STN:
+                /* the address isn't known until run time */
+                ok = 0;
+                break;
+            case STP:
+                break;
+        }
+    }
+    for (addr = 0; ok && addr < mem->size; addr++)
+    {
+        operand = get_operand(mem->data[addr]);
+        if (reached[addr] && get_opcode(mem->data[addr]) == STO
+            && operand < mem->size && reached[operand])
+        {
+            ok = 0;
+        }
+    }
+    for (addr = 0; ok && addr < mem->size; addr++)
+    {
+        in = &prog[addr];
+        in->word = mem->data[addr];
+        in->operand = get_operand(in->word);
+        if (!reached[addr])
+        {
+            in->kind = V_UNREACHABLE;
+            continue;
+        }
+        switch (get_opcode(in->word))
+        {
+            case LDA: in->kind = in->operand == IO_ADDRESS ? V_LDA_IO : V_LDA; break;
+            case STO: in->kind = in->operand == IO_ADDRESS ? V_STO_IO : V_STO; break;
+            case ADD: in->kind = in->operand == IO_ADDRESS ? V_ADD_IO : V_ADD; break;
+            case SUB: in->kind = in->operand == IO_ADDRESS ? V_SUB_IO : V_SUB; break;
+            case AND: in->kind = in->operand == IO_ADDRESS ? V_AND_IO : V_AND; break;
+            case JMP: in->kind = V_JMP; break;
+            case JGE: in->kind = V_JGE; break;
+            case JNE: in->kind = V_JNE; break;
+            case STP: in->kind = V_STP; break;
+            case LDI: in->kind = V_LDI; break;
+            case SHL: in->kind = V_SHL; break;
+            case SHR: in->kind = V_SHR; break;
+            default: in->kind = V_UNREACHABLE; break;
+        }
+    }
+    free(reached);
+    free(stack);
+    if (!ok)
+    {
+        free(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+/* Verifies from the instruction the cpu runs next, which it may already
+ * have fetched, for a run that does not start from reset */
+vinsn_t *verify_resume(cpu_t *cpu, memory_t *mem, int extended)
+{
+    int entry = cpu->state == EXECUTE ? cpu->PC - 1 : cpu->PC;
+    if (cpu->done || entry < 0 || entry >= (int) mem->size
+        || (cpu->state == EXECUTE && mem->data[entry] != cpu->IR))
+    {
+        return NULL;
+    }
+    return verify(mem, extended, entry);
+}
+
+/* Runs a verified image for as many whole instructions as the limit
+ * allows, leaving any last cycle to the checked interpreter. It also stops
+ * short of anything the verifier did not reach, and with one_block set
+ * after the first jump, where the tiers' blocks end. */
+void run_verified(cpu_t *cpu, memory_t *mem, int limit, int one_block)
+{
+    vinsn_t *prog = mem->verified;
+    uint16_t *data = mem->data;
+    vinsn_t *in;
+    int pc = cpu->PC;
+    int acc = cpu->ACC;
+    int steps = cpu->steps;
+    /* cycles the next instruction costs, 1 if a jump already fetched it */
+    int cost = cpu->state == EXECUTE ? 1 : 2;
+    int done = 0;
+    int stop = 0;
+
+    if (limit > 0 && steps + cost > limit)
+    {
+        return;
+    }
+    if (cpu->state == EXECUTE)
+    {
+        pc--;
+    }
+    in = NULL;
+    while ((limit <= 0 || steps + cost <= limit) && pc >= 0 && pc < (int) mem->size
+        && prog[pc].kind != V_UNREACHABLE)
+    {
+        in = &prog[pc++];
+        steps += cost;
+        cost = 2;
+        switch (in->kind)
+        {
+            case V_LDA: acc = (int16_t) data[in->operand]; break;
+            case V_LDA_IO: acc = read_input(mem->io); break;
+            case V_STO: data[in->operand] = acc; break;
+            case V_STO_IO:
+                cpu->steps = steps;
+                set(mem, IO_ADDRESS, acc);
+                break;
+            case V_ADD: acc = (int16_t) (acc + (int16_t) data[in->operand]); break;
+            case V_ADD_IO: acc = (int16_t) (acc + read_input(mem->io)); break;
+            case V_SUB: acc = (int16_t) (acc - (int16_t) data[in->operand]); break;
+            case V_SUB_IO: acc = (int16_t) (acc - read_input(mem->io)); break;
+            case V_AND: acc &= (int16_t) data[in->operand]; break;
+            case V_AND_IO: acc &= read_input(mem->io); break;
+            case V_JMP:
+                pc = in->operand;
+                cost = 1;
+                stop = one_block;
+                break;
+            case V_JGE:
+                if (acc >= 0)
+                {
+                    pc = in->operand;
+                    cost = 1;
+                }
+                stop = one_block;
+                break;
+            case V_JNE:
+                if (acc != 0)
+                {
+                    pc = in->operand;
+                    cost = 1;
+                }
+                stop = one_block;
+                break;
+            case V_LDI: acc = in->operand; break;
+            case V_SHL: acc = (int16_t) ((unsigned int) acc << (in->operand & 0x1f)); break;
+            case V_SHR: acc >>= in->operand & 0x1f; break;
+            case V_STP:
+                done = stop = 1;
+                break;
+            case V_UNREACHABLE:
+                break;
+        }
+        if (stop)
+        {
+            break;
+        }
+    }
+    if (in == NULL)
+    {
+        return;
+    }
+    cpu->ACC = acc;
+    cpu->steps = steps;
+    cpu->done = done;
+    if (cost == 1)
+    {
+        /* the last jump fetched its target, which may not have been reached */
+        cpu->PC = pc + 1;
+        cpu->IR = get(mem, pc);
+        cpu->state = EXECUTE;
+    }
+    else
+    {
+        cpu->PC = pc;
+        cpu->IR = in->word;
+        cpu->state = done ? EXECUTE : FETCH;
+    }
+}
+
+/* Runs until the cpu stops or reaches the limit. Returns if it stopped. */
+int execute(cpu_t *cpu, memory_t *mem, int verbose, int extended, int limit, tiers_t *t)
+{
+    /* without native code the tiers have nothing faster than a verified
+     * image's own engine */
+    if ((t == NULL || t->arena == NULL) && mem->verified != NULL && !verbose)
+    {
+        run_verified(cpu, mem, limit, 0);
+    }
+    if (t == NULL)
+    {
+        return run(cpu, mem, verbose, extended, limit, -1);
+    }
+    while (!cpu->done && within_limit(cpu, limit))
+    {
+        run_tiered(t, cpu, mem, extended, limit);
+        if (t->config.cold > 0 && cpu->steps >= t->next_cold)
+        {
+            drop_cold_blocks(t, mem);
+            t->next_cold = cpu->steps + t->config.cold;
+        }
+    }
+    return cpu->done;
+}
+
+/* Returns if the next cycle would read from IO_ADDRESS */
+int reads_input(cpu_t *cpu, memory_t *mem, int extended)
+{
+    int operand = get_operand(cpu->IR);
+    if (cpu->state == FETCH)
+    {
+        return cpu->PC == IO_ADDRESS;
+    }
+    if (!extended && get_opcode(cpu->IR) >= NUM_OPCODES)
+    {
+        return 0;
+    }
+    switch (get_opcode(cpu->IR))
+    {
+        case LDA:
+        case ADD:
+        case SUB:
+        case AND:
+        case JMP:
+        case STN:
+            return operand == IO_ADDRESS;
+        case JGE:
+            return cpu->ACC >= 0 && operand == IO_ADDRESS;
+        case JNE:
+            return cpu->ACC != 0 && operand == IO_ADDRESS;
+        case LDN:
+            return operand == IO_ADDRESS
+                || (operand <= mem->size && get_operand(mem->data[operand]) == IO_ADDRESS);
+        default:
+            return 0;
+    }
+}
+
+/* Runs to the end, or with prefix set just up to reading past the input in
+ * io, with out of range accesses and unexpected output ending the run rather
+ * than the process */
+enum outcome_t run_guarded(cpu_t *cpu, memory_t *mem, int verbose, int extended, int limit,
+    tiers_t *t, int prefix)
+{
+    jmp_buf fault;
+    mem->fault = &fault;
+    switch (setjmp(fault))
+    {
+        case FAULT:
+            mem->fault = NULL;
+            return FAULT;
+        case MISMATCH:
+            mem->fault = NULL;
+            return MISMATCH;
+    }
+    if (prefix)
+    {
+        while (!cpu->done && within_limit(cpu, limit)
+            && !(reads_input(cpu, mem, extended) && mem->io->input_pos >= mem->io->input_size))
+        {
+            cpu->steps++;
+            cycle(cpu, mem, extended);
+        }
+    }
+    else
+    {
+        execute(cpu, mem, verbose, extended, limit, t);
+    }
+    mem->fault = NULL;
+    return cpu->done ? STOPPED : LIMIT;
+}
+
+/* Returns if the output was as expected */
+int report_expected(io_t *io, cpu_t *cpu, enum outcome_t outcome)
+{
+    if (outcome == MISMATCH && io->written < io->expect_size)
+    {
+        fprintf(stderr, "Output differs at byte %zu on cycle %d: expected 0x%02x, got 0x%02x\n",
+            io->written, cpu->steps, io->expect[io->written], io->unexpected);
+    }
+    else if (outcome == MISMATCH)
+    {
+        fprintf(stderr, "Unexpected output after byte %zu on cycle %d: 0x%02x\n",
+            io->written, cpu->steps, io->unexpected);
+    }
+    else if (io->written < io->expect_size)
+    {
+        fprintf(stderr, "Output ended after byte %zu of %zu on cycle %d\n",
+            io->written, io->expect_size, cpu->steps);
+    }
+    else
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/* Returns zero, or one if the output did not match what was expected */
+int emulate(memory_t *mem, int verbose, int extended, int limit, const tiering_t *tiering,
+    cosim_t *cosim, result_cache_t *cache, wave_t *wave)
+{
+    cpu_t cpu;
+    tiers_t *t = NULL;
+    enum outcome_t outcome;
+    result_t result;
+    io_t *io = mem->io;
+    int status = 0;
+    int cached = 0;
+    init_cpu(&cpu, 0);
+    mem->clock = &cpu.steps;
+    /* with a cache the input is all in io and the output is kept there */
+    if (cache != NULL && !verbose && cosim == NULL && wave == NULL
+        && find_result(cache, io->input, io->input_size, &result))
+    {
+        /* a result that fails --expect is run again to say where */
+        cached = io->expect == NULL || (result.output_size == io->expect_size
+            && !memcmp(result.output, io->expect, io->expect_size));
+        if (cached)
+        {
+            fwrite(result.output, 1, result.output_size, stdout);
+            io->written = result.output_size;
+            outcome = result.outcome;
+            cpu.steps = result.steps;
+            mem->fault_address = result.fault_address;
+        }
+        free(result.output);
+    }
+    if (!cached && cosim != NULL)
+    {
+        outcome = run_cosim(&cpu, mem, verbose, extended, limit, cosim);
+    }
+    else if (!cached && wave != NULL)
+    {
+        outcome = run_waves(&cpu, mem, extended, limit, wave);
+        close_wave(wave);
+    }
+    else if (!cached)
+    {
+        mem->verified = verify(mem, extended, 0);
+        t = start_tiers(mem, verbose, tiering);
+        outcome = run_guarded(&cpu, mem, verbose, extended, limit, t, 0);
+    }
+    if (cache != NULL && !cached)
+    {
+        fwrite(io->output, 1, io->output_size, stdout);
+        if (outcome != MISMATCH && outcome != DIVERGED)
+        {
+            result.outcome = outcome;
+            result.fault_address = mem->fault_address;
+            result.steps = cpu.steps;
+            result.output = io->output;
+            result.output_size = io->output_size;
+            store_result(cache, io->input, io->input_size, &result);
+        }
+    }
+    if (outcome == FAULT)
+    {
+        fprintf(stderr, "Memory address 0x%x is out of range\n", mem->fault_address);
+        // exit code for SIGSEGV
+        exit(139);
+    }
+    if (outcome == LIMIT)
+    {
+        fprintf(stderr, "Step limit exceeded\n");
+    }
+    if (outcome == DIVERGED)
+    {
+        status = 1;
+    }
+    if (mem->io != NULL && mem->io->expect != NULL && !report_expected(mem->io, &cpu, outcome))
+    {
+        status = 1;
+    }
+    if (t != NULL)
+    {
+        if (t->config.stats)
+        {
+            print_tier_stats(&t->stats);
+        }
+        free_tiers(t, mem);
+    }
+    return status;
+}
+
+/* ------------------------------------------- */
+/* ---------------- MULTICORE ---------------- */
+/* ------------------------------------------- */
+
+typedef struct {
+    cpu_t cpu;
+    memory_t *mem;
+    int verbose;
+    int extended;
+    int limit;
+    int core;
+} core_t;
+
+void *run_core(void *arg)
+{
+    core_t *c = arg;
+    run(&c->cpu, c->mem, c->verbose, c->extended, c->limit, c->core);
+    return NULL;
+}
+
+/* All cores share mem and start at address 0 with their core number in
+ * the accumulator. In lockstep every core runs one cycle, in core order,
+ * before any core runs the next, so runs are repeatable. Relaxed gives
+ * each core its own thread and makes no promises about the order of
+ * memory accesses between cores other than through the lock. */
+void emulate_cores(memory_t *mem, int verbose, int extended, int limit, int cores, int relaxed)
+{
+    core_t *c;
+    pthread_t *threads;
+    int running;
+    int i;
+
+    c = malloc(cores * sizeof(core_t));
+    threads = malloc(cores * sizeof(pthread_t));
+    if (c == NULL || threads == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    mem->lock_device = 1;
+    mem->lock = 0;
+    for (i = 0; i < cores; i++)
+    {
+        init_cpu(&c[i].cpu, i);
+        c[i].mem = mem;
+        c[i].verbose = verbose;
+        c[i].extended = extended;
+        c[i].limit = limit;
+        c[i].core = i;
+    }
+    if (relaxed)
+    {
+        mem->shared = 1;
+        for (i = 0; i < cores; i++)
+        {
+            if (pthread_create(&threads[i], NULL, run_core, &c[i]) != 0)
+            {
+                fprintf(stderr, "Could not start core %d\n", i);
+                exit(1);
+            }
+        }
+        for (i = 0; i < cores; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        mem->shared = 0;
+    }
+    else
+    {
+        do
+        {
+            running = 0;
+            for (i = 0; i < cores; i++)
+            {
+                if (!c[i].cpu.done && within_limit(&c[i].cpu, limit))
+                {
+                    c[i].cpu.steps++;
+                    if (verbose)
+                    {
+                        trace_cycle(&c[i].cpu, i);
+                    }
+                    cycle(&c[i].cpu, mem, extended);
+                    running = 1;
+                }
+            }
+        } while (running);
+    }
+    for (i = 0; i < cores; i++)
+    {
+        if (!c[i].cpu.done)
+        {
+            fprintf(stderr, "Core %d: step limit exceeded\n", i);
+        }
+    }
+    free(threads);
+    free(c);
+}
+
+/* ------------------------------------------- */
+/* ------------------ BATCH ------------------ */
+/* ------------------------------------------- */
+
+/* A batch runs one image against many inputs. Everything up to the
+ * first read from IO_ADDRESS is the same for every input, so it is run
+ * once and each input starts from a snapshot of the machine at that
+ * point, keeping the cycles and output of the prefix. */
+
+typedef struct {
+    cpu_t cpu;
+    uint16_t *data;
+    arith_t arith;
+    unsigned char *output;
+    size_t output_size;
+    enum outcome_t outcome;
+    int fault_address;
+    int resume;  /* stopped at the first input rather than finishing */
+} snapshot_t;
+
+void take_snapshot(snapshot_t *snap, cpu_t *cpu, memory_t *mem, io_t *io)
+{
+    snap->cpu = *cpu;
+    snap->data = malloc((mem->size + 1) * sizeof(uint16_t));
+    snap->output = malloc(io->output_size + 1);
+    if (snap->data == NULL || snap->output == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    memcpy(snap->data, mem->data, (mem->size + 1) * sizeof(uint16_t));
+    snap->arith = mem->arith;
+    if (io->output_size > 0)
+    {
+        memcpy(snap->output, io->output, io->output_size);
+    }
+    snap->output_size = io->output_size;
+}
+
+void restore_snapshot(snapshot_t *snap, cpu_t *cpu, memory_t *mem, io_t *io)
+{
+    size_t i;
+    *cpu = snap->cpu;
+    memcpy(mem->data, snap->data, (mem->size + 1) * sizeof(uint16_t));
+    mem->arith = snap->arith;
+    io->output_size = 0;
+    for (i = 0; i < snap->output_size; i++)
+    {
+        write_output(io, snap->output[i]);
+    }
+}
+
+void report(const char *name, cpu_t *cpu, enum outcome_t outcome, int fault_address)
+{
+    printf("%s: %d cycles", name, cpu->steps);
+    if (outcome == LIMIT)
+    {
+        printf(" (step limit exceeded)");
+    }
+    else if (outcome == FAULT)
+    {
+        printf(" (memory address 0x%x is out of range)", fault_address);
+    }
+    printf("\n");
+}
+
+/* Runs mem against each input file, writing the output of each to the
+ * input's name with .out added */
+void batch(memory_t *mem, int extended, int limit, const tiering_t *tiering,
+    result_cache_t *cache, char **inputs, int count)
+{
+    snapshot_t snap;
+    cpu_t cpu;
+    io_t io;
+    tiers_t *t;
+    source_t *src;
+    result_t result;
+    int cached;
+    char *name;
+    FILE *f;
+    int i;
+
+    memset(&io, 0, sizeof(io));
+    mem->io = &io;
+    init_cpu(&cpu, 0);
+    mem->clock = &cpu.steps;
+    snap.outcome = run_guarded(&cpu, mem, 0, extended, limit, NULL, 1);
+    snap.fault_address = mem->fault_address;
+    snap.resume = snap.outcome == LIMIT && within_limit(&cpu, limit);
+    take_snapshot(&snap, &cpu, mem, &io);
+    /* set-up may have stored over code, so verify from where runs resume */
+    mem->verified = verify_resume(&cpu, mem, extended);
+    t = start_tiers(mem, 0, tiering);
+
+    for (i = 0; i < count; i++)
+    {
+        f = fopen(inputs[i], "rb");
+        if (f == NULL)
+        {
+            fprintf(stderr, "Could not open %s\n", inputs[i]);
+            continue;
+        }
+        src = open_source(f);
+        fclose(f);
+        cached = cache != NULL
+            && find_result(cache, (const unsigned char *) src->data, src->size, &result);
+        if (!cached)
+        {
+            restore_snapshot(&snap, &cpu, mem, &io);
+            io.input = (const unsigned char *) src->data;
+            io.input_size = src->size;
+            io.input_pos = 0;
+            result.outcome = snap.outcome;
+            mem->fault_address = snap.fault_address;
+            if (snap.resume)
+            {
+                if (t != NULL)
+                {
+                    reset_tiers(t, mem);
+                }
+                result.outcome = run_guarded(&cpu, mem, 0, extended, limit, t, 0);
+            }
+            result.fault_address = mem->fault_address;
+            result.steps = cpu.steps;
+            result.output = io.output;
+            result.output_size = io.output_size;
+            if (cache != NULL)
+            {
+                store_result(cache, (const unsigned char *) src->data, src->size, &result);
+            }
+        }
+        cpu.steps = result.steps;
+        report(inputs[i], &cpu, result.outcome, result.fault_address);
+        name = malloc(strlen(inputs[i]) + 5);
+        sprintf(name, "%s.out", inputs[i]);
+        f = fopen(name, "wb");
+        if (f == NULL)
+        {
+            fprintf(stderr, "Could not open %s\n", name);
+        }
+        else
+        {
+            fwrite(result.output, 1, result.output_size, f);
+            fclose(f);
+        }
+        if (cached)
+        {
+            free(result.output);
+        }
+        free(name);
+        close_source(src);
+    }
+
+    if (t != NULL)
+    {
+        free_tiers(t, mem);
+    }
+    mem->io = NULL;
+    free(io.output);
+    free(snap.data);
+    free(snap.output);
+}
+
+/* ------------------------------------------- */
+/* ------------------ FUZZ ------------------- */
+/* ------------------------------------------- */
+
+/* Searches the input space of a program for reads that crash it or runs
+ * that hit the step limit. Each input is run from the snapshot taken at
+ * the first read, recording which jumps were taken or not in a small
+ * edge map, and inputs reaching new edges join the corpus. */
+
+#define EDGE_MAP_SIZE 8192
+#define MAX_FUZZ_INPUT 4096
+#define MAX_CORPUS 4096
+
+typedef struct {
+    unsigned char *data;
+    int size;
+} fuzz_input_t;
+
+typedef struct {
+    unsigned char edges[EDGE_MAP_SIZE];
+    unsigned char seen[EDGE_MAP_SIZE];
+    fuzz_input_t corpus[MAX_CORPUS];
+    int corpus_size;
+    unsigned long rng;
+    long runs;
+    long crashes;
+    long hangs;
+    int edge_count;
+    const char *dir;
+} fuzzer_t;
+
+unsigned long next_random(fuzzer_t *f)
+{
+    /* xorshift64 */
+    f->rng ^= f->rng << 13;
+    f->rng ^= f->rng >> 7;
+    f->rng ^= f->rng << 17;
+    return f->rng;
+}
+
+int is_jump(int word)
+{
+    enum opcode_t op = get_opcode(word);
+    return op == JMP || op == JGE || op == JNE;
+}
+
+/* Runs with every jump recorded as an edge from its address to where
+ * execution went next */
+void run_covered(fuzzer_t *f, cpu_t *cpu, memory_t *mem, int extended, int limit)
+{
+    int from;
+    int to;
+    while (!cpu->done && within_limit(cpu, limit))
+    {
+        from = cpu->state == EXECUTE && is_jump(cpu->IR) ? cpu->PC - 1 : -1;
+        cpu->steps++;
+        cycle(cpu, mem, extended);
+        if (from >= 0)
+        {
+            to = cpu->state == EXECUTE ? cpu->PC - 1 : cpu->PC;
+            to = ((from * 0x9e5) ^ to) & (EDGE_MAP_SIZE - 1);
+            if (f->edges[to] < 0xff)
+            {
+                f->edges[to]++;
+            }
+        }
+    }
+}
+
+enum outcome_t fuzz_one(fuzzer_t *f, cpu_t *cpu, memory_t *mem, int extended, int limit)
+{
+    jmp_buf fault;
+    mem->fault = &fault;
+    if (setjmp(fault))
+    {
+        mem->fault = NULL;
+        return FAULT;
+    }
+    run_covered(f, cpu, mem, extended, limit);
+    mem->fault = NULL;
+    return cpu->done ? STOPPED : LIMIT;
+}
+
+/* Hit counts are compared in power of two buckets, like AFL */
+int bucket(int hits)
+{
+    int b = 1;
+    while (hits > 1)
+    {
+        b <<= 1;
+        hits >>= 1;
+    }
+    return b;
+}
+
+/* Returns if the last run reached an edge, or a bucket of an edge, for
+ * the first time */
+int new_coverage(fuzzer_t *f)
+{
+    unsigned long word;
+    int i;
+    int b;
+    int found = 0;
+    for (i = 0; i < EDGE_MAP_SIZE; i++)
+    {
+        if (i % sizeof(long) == 0 && (memcpy(&word, f->edges + i, sizeof(long)), word == 0))
+        {
+            /* most of the map is empty, skip it a word at a time */
+            i += sizeof(long) - 1;
+        }
+        else if (f->edges[i])
+        {
+            b = bucket(f->edges[i]);
+            if (!(f->seen[i] & b))
+            {
+                if (!f->seen[i])
+                {
+                    f->edge_count++;
+                }
+                f->seen[i] |= b;
+                found = 1;
+            }
+        }
+    }
+    return found;
+}
+
+void save_input(fuzzer_t *f, const char *kind, long n, unsigned char *data, int size)
+{
+    char name[4096];
+    FILE *out;
+    snprintf(name, sizeof(name), "%s/%s-%ld", f->dir, kind, n);
+    out = fopen(name, "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", name);
+        return;
+    }
+    fwrite(data, 1, size, out);
+    fclose(out);
+}
+
+void add_to_corpus(fuzzer_t *f, unsigned char *data, int size)
+{
+    fuzz_input_t *in;
+    if (f->corpus_size == MAX_CORPUS)
+    {
+        return;
+    }
+    in = &f->corpus[f->corpus_size];
+    in->data = malloc(size + 1);
+    if (in->data == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    memcpy(in->data, data, size);
+    in->size = size;
+    save_input(f, "corpus", f->corpus_size, data, size);
+    f->corpus_size++;
+}
+
+/* Saves an input that crashed or hung */
+void save_finding(fuzzer_t *f, enum outcome_t outcome, cpu_t *cpu, memory_t *mem,
+    unsigned char *data, int size)
+{
+    if (outcome == FAULT)
+    {
+        fprintf(stderr, "Crash: memory address 0x%x on cycle %d\n", mem->fault_address, cpu->steps);
+        save_input(f, "crash", f->crashes++, data, size);
+    }
+    else if (outcome == LIMIT)
+    {
+        save_input(f, "hang", f->hangs++, data, size);
+    }
+}
+
+/* Applies a few random edits to buf, returning the new size */
+int mutate(fuzzer_t *f, unsigned char *buf, int size)
+{
+    static const unsigned char interesting[] = {
+        0, 1, '\n', ' ', '0', '9', 'a', 'q', 'z', 0x7f, 0x80, 0xff
+    };
+    fuzz_input_t *other;
+    int edits = 1 + next_random(f) % 4;
+    int pos;
+    int n;
+    while (edits--)
+    {
+        pos = size > 0 ? next_random(f) % size : 0;
+        switch (next_random(f) % 6)
+        {
+            case 0:
+                if (size > 0)
+                {
+                    buf[pos] ^= 1 << (next_random(f) % 8);
+                }
+                break;
+            case 1:
+                if (size > 0)
+                {
+                    buf[pos] = next_random(f);
+                }
+                break;
+            case 2:
+                if (size > 0)
+                {
+                    buf[pos] = interesting[next_random(f) % sizeof(interesting)];
+                }
+                break;
+            case 3:
+                if (size < MAX_FUZZ_INPUT)
+                {
+                    /* inserts can also go on the end */
+                    pos = next_random(f) % (size + 1);
+                    memmove(buf + pos + 1, buf + pos, size - pos);
+                    buf[pos] = interesting[next_random(f) % sizeof(interesting)];
+                    size++;
+                }
+                break;
+            case 4:
+                if (size > 0)
+                {
+                    memmove(buf + pos, buf + pos + 1, size - pos - 1);
+                    size--;
+                }
+                break;
+            case 5:
+                /* splice in the tail of another corpus entry */
+                other = &f->corpus[next_random(f) % f->corpus_size];
+                if (other->size > 0)
+                {
+                    n = next_random(f) % other->size;
+                    if (pos + other->size - n > MAX_FUZZ_INPUT)
+                    {
+                        n = other->size - (MAX_FUZZ_INPUT - pos);
+                    }
+                    memcpy(buf + pos, other->data + n, other->size - n);
+                    size = pos + other->size - n;
+                }
+                break;
+        }
+    }
+    return size;
+}
+
+void fuzz(memory_t *mem, int extended, int limit, long runs, unsigned long seed,
+    const char *dir, char **seeds, int count)
+{
+    fuzzer_t *f;
+    unsigned char buf[MAX_FUZZ_INPUT];
+    snapshot_t snap;
+    cpu_t cpu;
+    io_t io;
+    source_t *src;
+    FILE *in;
+    fuzz_input_t *parent;
+    enum outcome_t outcome;
+    int size;
+    int i;
+
+    mkdir(dir, 0777);
+    f = calloc(1, sizeof(fuzzer_t));
+    if (f == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    f->rng = seed ? seed : 0x2545f4914f6cdd1d;
+    f->dir = dir;
+    memset(&io, 0, sizeof(io));
+    io.input = buf;
+    mem->io = &io;
+    init_cpu(&cpu, 0);
+    mem->clock = &cpu.steps;
+    snap.outcome = run_guarded(&cpu, mem, 0, extended, limit, NULL, 1);
+    if (snap.outcome != LIMIT || !within_limit(&cpu, limit))
+    {
+        fprintf(stderr, "The program finishes without reading any input\n");
+        mem->io = NULL;
+        free(io.output);
+        free(f);
+        return;
+    }
+    take_snapshot(&snap, &cpu, mem, &io);
+
+    /* the seeds, or a single empty input, start the corpus */
+    for (i = 0; i <= count; i++)
+    {
+        size = 0;
+        if (i < count)
+        {
+            in = fopen(seeds[i], "rb");
+            if (in == NULL)
+            {
+                fprintf(stderr, "Could not open %s\n", seeds[i]);
+                continue;
+            }
+            src = open_source(in);
+            fclose(in);
+            size = src->size < MAX_FUZZ_INPUT ? src->size : MAX_FUZZ_INPUT;
+            memcpy(buf, src->data, size);
+            close_source(src);
+        }
+        else if (f->corpus_size > 0)
+        {
+            break;
+        }
+        restore_snapshot(&snap, &cpu, mem, &io);
+        io.input_size = size;
+        io.input_pos = 0;
+        memset(f->edges, 0, sizeof(f->edges));
+        outcome = fuzz_one(f, &cpu, mem, extended, limit);
+        new_coverage(f);
+        save_finding(f, outcome, &cpu, mem, buf, size);
+        add_to_corpus(f, buf, size);
+    }
+
+    while (runs <= 0 || f->runs < runs)
+    {
+        parent = &f->corpus[next_random(f) % f->corpus_size];
+        memcpy(buf, parent->data, parent->size);
+        size = mutate(f, buf, parent->size);
+
+        restore_snapshot(&snap, &cpu, mem, &io);
+        io.input_size = size;
+        io.input_pos = 0;
+        memset(f->edges, 0, sizeof(f->edges));
+        outcome = fuzz_one(f, &cpu, mem, extended, limit);
+        f->runs++;
+        if (!new_coverage(f))
+        {
+            continue;
+        }
+        save_finding(f, outcome, &cpu, mem, buf, size);
+        add_to_corpus(f, buf, size);
+    }
+
+    printf("%ld runs, %d edges, %d inputs in the corpus, %ld crashes, %ld hangs\n",
+        f->runs, f->edge_count, f->corpus_size, f->crashes, f->hangs);
+    for (i = 0; i < f->corpus_size; i++)
+    {
+        free(f->corpus[i].data);
+    }
+    free(f);
+    mem->io = NULL;
+    free(io.output);
+    free(snap.data);
+    free(snap.output);
+}
+
+/* ------------------------------------------- */
+/* ------------------- WCET ------------------ */
+/* ------------------------------------------- */
+
+/* Finds an upper bound on the cycles a verified image can take. Every jump
+ * back to an earlier address closes a loop, and loops must nest and only
+ * be entered at their start. A loop is bounded if it ends with
+ *     LDA c / SUB k / STO c / JGE or JNE start
+ * where k is never stored to and the starting value of c is known, or if
+ * every pass reads input and the number of reads is limited. Loops are
+ * costed innermost first as their passes times their longest pass, and
+ * then stand in for a single step of the code around them. */
+
+typedef struct {
+    int start;
+    int end;
+    unsigned long passes;
+    unsigned long pass_cost;
+    int *exits;
+    int exit_count;
+} wcet_loop_t;
+
+typedef struct {
+    vinsn_t *prog;
+    uint16_t *data;
+    int size;
+    /* the most reads of IO_ADDRESS, or 0 for no limit */
+    int reads;
+    /* the loop starting at each address, or -1 */
+    int *loop_at;
+    wcet_loop_t *loops;
+    int loop_count;
+    /* how many reachable STO and jumps write to or go to each address */
+    int *stores;
+    int *targets;
+    /* most cycles from fetching each address to leaving its loop */
+    unsigned long *dist;
+    /* the loop with no bound and why, if any */
+    int culprit;
+    char reason[128];
+} wcet_t;
+
+unsigned long sat_add(unsigned long a, unsigned long b)
+{
+    return a > ULONG_MAX - b ? ULONG_MAX : a + b;
+}
+
+unsigned long sat_mul(unsigned long a, unsigned long b)
+{
+    return b != 0 && a > ULONG_MAX / b ? ULONG_MAX : a * b;
+}
+
+int is_jump_kind(enum vkind_t kind)
+{
+    return kind == V_JMP || kind == V_JGE || kind == V_JNE;
+}
+
+int reads_kind(enum vkind_t kind)
+{
+    return kind == V_LDA_IO || kind == V_ADD_IO || kind == V_SUB_IO || kind == V_AND_IO;
+}
+
+int compare_loops(const void *a, const void *b)
+{
+    const wcet_loop_t *x = a;
+    const wcet_loop_t *y = b;
+    return (x->end - x->start) - (y->end - y->start);
+}
+
+int no_bound(wcet_t *w, int loop, const char *reason)
+{
+    w->culprit = loop;
+    snprintf(w->reason, sizeof(w->reason), "%s", reason);
+    return 0;
+}
+
+/* Collects the loops, innermost first. Returns 0 if they don't nest. */
+int find_loops(wcet_t *w)
+{
+    wcet_loop_t *l;
+    int a;
+    int i;
+    int j;
+    int t;
+    for (a = 0; a < w->size; a++)
+    {
+        if (is_jump_kind(w->prog[a].kind) && w->prog[a].operand <= a)
+        {
+            t = w->prog[a].operand;
+            for (i = 0; i < w->loop_count; i++)
+            {
+                if (w->loops[i].start == t)
+                {
+                    return no_bound(w, i, "has more than one jump back to its start");
+                }
+            }
+            l = &w->loops[w->loop_count++];
+            l->start = t;
+            l->end = a;
+        }
+    }
+    qsort(w->loops, w->loop_count, sizeof(wcet_loop_t), compare_loops);
+    for (i = 0; i < w->loop_count; i++)
+    {
+        l = &w->loops[i];
+        w->loop_at[l->start] = i;
+        for (j = 0; j < w->loop_count; j++)
+        {
+            if (l->start < w->loops[j].start && w->loops[j].start <= l->end
+                && l->end < w->loops[j].end)
+            {
+                return no_bound(w, i, "overlaps another loop");
+            }
+        }
+        for (a = 0; a < w->size; a++)
+        {
+            t = w->prog[a].operand;
+            if (is_jump_kind(w->prog[a].kind) && t > l->start && t <= l->end
+                && (a < l->start || a > l->end))
+            {
+                return no_bound(w, i, "is entered in the middle");
+            }
+        }
+    }
+    return 1;
+}
+
+/* Returns the value a counter is set to just before the loop, or the
+ * image's value if nothing else sets it and the loop only runs once */
+int counter_start(wcet_t *w, wcet_loop_t *l, int counter, int *value)
+{
+    vinsn_t *p = w->prog;
+    int a;
+    int i;
+    if (w->targets[l->start] == 1)
+    {
+        for (a = l->start - 1; a > 0 && p[a].kind != V_UNREACHABLE
+            && !is_jump_kind(p[a].kind) && p[a].kind != V_STP; a--)
+        {
+            if (p[a].kind == V_STO && p[a].operand == counter)
+            {
+                if (w->targets[a])
+                {
+                    break;
+                }
+                if (p[a-1].kind == V_LDA && !w->stores[p[a-1].operand])
+                {
+                    *value = (int16_t) w->data[p[a-1].operand];
+                    return 1;
+                }
+                if (p[a-1].kind == V_LDI)
+                {
+                    *value = p[a-1].operand;
+                    return 1;
+                }
+                break;
+            }
+            if (w->targets[a])
+            {
+                break;
+            }
+        }
+    }
+    for (i = 0; i < w->loop_count; i++)
+    {
+        if (&w->loops[i] != l && w->loops[i].start <= l->start && w->loops[i].end >= l->end)
+        {
+            return 0;
+        }
+    }
+    if (w->stores[counter] == 1)
+    {
+        *value = (int16_t) w->data[counter];
+        return 1;
+    }
+    return 0;
+}
+
+/* Returns if the three instructions at a are LDA c / SUB k / STO c with
+ * nothing jumping past the LDA */
+int is_countdown(wcet_t *w, int a)
+{
+    vinsn_t *p = w->prog;
+    return p[a].kind == V_LDA && p[a+1].kind == V_SUB && p[a+2].kind == V_STO
+        && p[a+2].operand == p[a].operand && p[a+1].operand != p[a].operand
+        && !w->targets[a+1] && !w->targets[a+2];
+}
+
+/* Works out how many passes a loop can make. Returns 0 if there's no
+ * bound. */
+int count_passes(wcet_t *w, int loop)
+{
+    wcet_loop_t *l = &w->loops[loop];
+    vinsn_t *p = w->prog;
+    int j = l->end;
+    int countdown = -1;
+    int counter;
+    int step;
+    int value;
+    int a;
+    if ((p[j].kind == V_JGE || p[j].kind == V_JNE) && !w->targets[j])
+    {
+        /* the test is either straight after the count down, or of the
+         * counter reloaded after a count down at the start of the loop */
+        if (j - 3 >= l->start && is_countdown(w, j - 3))
+        {
+            countdown = j - 3;
+        }
+        else if (j - 1 >= l->start && p[j-1].kind == V_LDA)
+        {
+            for (a = l->start; a + 2 < j - 1; a++)
+            {
+                if ((a > l->start && w->targets[a]) || is_jump_kind(p[a].kind) || p[a].kind == V_STP)
+                {
+                    break;
+                }
+                if (is_countdown(w, a) && p[a].operand == p[j-1].operand)
+                {
+                    countdown = a;
+                    break;
+                }
+            }
+        }
+    }
+    if (countdown >= 0)
+    {
+        counter = p[countdown].operand;
+        step = (int16_t) w->data[p[countdown+1].operand];
+        if (w->stores[p[countdown+1].operand] || step <= 0)
+        {
+            return no_bound(w, loop, "does not count down by a fixed amount");
+        }
+        for (a = l->start; a <= j; a++)
+        {
+            if (p[a].kind == V_STO && p[a].operand == counter && a != countdown + 2)
+            {
+                return no_bound(w, loop, "changes its counter more than once a pass");
+            }
+        }
+        if (!counter_start(w, l, counter, &value))
+        {
+            return no_bound(w, loop, "has a counter with no known starting value");
+        }
+        if (p[j].kind == V_JGE)
+        {
+            l->passes = value < 0 ? 1 : value / step + 1;
+        }
+        else if (value > 0 && value % step == 0)
+        {
+            l->passes = value / step;
+        }
+        else
+        {
+            return no_bound(w, loop, "has a counter that never reaches zero");
+        }
+        return 1;
+    }
+    /* a read at the start is made on every pass */
+    for (a = l->start; a <= j; a++)
+    {
+        if (reads_kind(p[a].kind))
+        {
+            if (w->reads <= 0)
+            {
+                return no_bound(w, loop, "reads input on every pass, give --reads n to bound it");
+            }
+            l->passes = w->reads;
+            return 1;
+        }
+        if (is_jump_kind(p[a].kind) || p[a].kind == V_STP || (a > l->start && w->targets[a]))
+        {
+            break;
+        }
+    }
+    return no_bound(w, loop, "is not a counted loop");
+}
+
+/* The cycles after moving from one address to the next, or none if the
+ * move leaves the loop being costed */
+unsigned long next_cost(wcet_t *w, wcet_loop_t *self, int lo, int hi, int to, int taken)
+{
+    int i;
+    if (to < lo || to > hi || (self != NULL && taken && to == self->start))
+    {
+        if (self != NULL && to != self->start)
+        {
+            for (i = 0; i < self->exit_count && self->exits[i] != to; i++)
+                ;
+            if (i == self->exit_count)
+            {
+                self->exits[self->exit_count++] = to;
+            }
+        }
+        return 0;
+    }
+    /* a taken jump fetches its target as it executes */
+    return w->dist[to] - taken;
+}
+
+/* Fills in dist from hi back to lo, with inner loops taken as a single
+ * step, for the whole program or one pass of self */
+void region_cost(wcet_t *w, wcet_loop_t *self, int lo, int hi, int *nodes)
+{
+    vinsn_t *in;
+    wcet_loop_t *inner;
+    unsigned long best;
+    unsigned long other;
+    int count = 0;
+    int a;
+    int i;
+    int k;
+    for (a = lo; a <= hi; )
+    {
+        nodes[count++] = a;
+        if (w->loop_at[a] >= 0 && (self == NULL || a != self->start))
+        {
+            a = w->loops[w->loop_at[a]].end + 1;
+        }
+        else
+        {
+            a++;
+        }
+    }
+    for (i = count - 1; i >= 0; i--)
+    {
+        a = nodes[i];
+        in = &w->prog[a];
+        if (w->loop_at[a] >= 0 && (self == NULL || a != self->start))
+        {
+            inner = &w->loops[w->loop_at[a]];
+            best = 0;
+            for (k = 0; k < inner->exit_count; k++)
+            {
+                other = next_cost(w, self, lo, hi, inner->exits[k], 0);
+                best = other > best ? other : best;
+            }
+            /* passes after the first start with their first fetch done */
+            w->dist[a] = sat_add(sat_add(sat_mul(inner->passes, inner->pass_cost - 1), 1), best);
+            continue;
+        }
+        switch (in->kind)
+        {
+            case V_UNREACHABLE:
+                w->dist[a] = 0;
+                break;
+            case V_STP:
+                w->dist[a] = 2;
+                break;
+            case V_JMP:
+                w->dist[a] = sat_add(2, next_cost(w, self, lo, hi, in->operand, 1));
+                break;
+            case V_JGE:
+            case V_JNE:
+                best = next_cost(w, self, lo, hi, in->operand, 1);
+                other = next_cost(w, self, lo, hi, a + 1, 0);
+                w->dist[a] = sat_add(2, other > best ? other : best);
+                break;
+            default:
+                w->dist[a] = sat_add(2, next_cost(w, self, lo, hi, a + 1, 0));
+                break;
+        }
+    }
+}
+
+int has_stop(wcet_t *w, wcet_loop_t *l)
+{
+    int a;
+    for (a = l->start; a <= l->end; a++)
+    {
+        if (w->prog[a].kind == V_STP)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Prints a bound on the cycles the image can take. Returns zero, or one
+ * if there is no bound. */
+int wcet(memory_t *mem, int extended, int reads, int verbose)
+{
+    wcet_t w;
+    wcet_loop_t *l;
+    int *nodes;
+    int bounded;
+    int a;
+    int i;
+
+    w.prog = verify(mem, extended, 0);
+    if (w.prog == NULL)
+    {
+        printf("Unbounded: the image may store over its own code, use LDN or STN,\n"
+            "or access memory out of range\n");
+        return 1;
+    }
+    w.data = mem->data;
+    w.size = mem->size;
+    w.reads = reads;
+    w.loop_count = 0;
+    w.culprit = -1;
+    w.loop_at = malloc(w.size * sizeof(int));
+    w.loops = calloc(w.size, sizeof(wcet_loop_t));
+    w.stores = calloc(w.size + 1, sizeof(int));
+    w.targets = calloc(w.size, sizeof(int));
+    w.dist = calloc(w.size, sizeof(unsigned long));
+    nodes = malloc(w.size * sizeof(int));
+    if (w.loop_at == NULL || w.loops == NULL || w.stores == NULL || w.targets == NULL
+        || w.dist == NULL || nodes == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    for (a = 0; a < w.size; a++)
+    {
+        w.loop_at[a] = -1;
+        if (w.prog[a].kind == V_STO)
+        {
+            w.stores[w.prog[a].operand]++;
+        }
+        if (is_jump_kind(w.prog[a].kind))
+        {
+            w.targets[w.prog[a].operand]++;
+        }
+    }
+
+    bounded = find_loops(&w);
+    for (i = 0; bounded && i < w.loop_count; i++)
+    {
+        l = &w.loops[i];
+        bounded = count_passes(&w, i);
+        if (bounded)
+        {
+            l->exits = malloc((2 * (l->end - l->start) + 2) * sizeof(int));
+            if (l->exits == NULL)
+            {
+                fprintf(stderr, "Memory allocation error\n");
+                exit(1);
+            }
+            region_cost(&w, l, l->start, l->end, nodes);
+            l->pass_cost = w.dist[l->start];
+            bounded = l->exit_count > 0 || has_stop(&w, l) || no_bound(&w, i, "has no way out");
+        }
+        if (bounded && verbose)
+        {
+            fprintf(stderr, "Loop 0x%03x-0x%03x: %lu passes of at most %lu cycles\n",
+                l->start, l->end, l->passes, l->pass_cost);
+        }
+    }
+    if (bounded)
+    {
+        region_cost(&w, NULL, 0, w.size - 1, nodes);
+        if (w.dist[0] == ULONG_MAX)
+        {
+            printf("Unbounded: the bound does not fit in 64 bits\n");
+            bounded = 0;
+        }
+        else
+        {
+            printf("At most %lu cycles\n", w.dist[0]);
+        }
+    }
+    else
+    {
+        l = &w.loops[w.culprit];
+        printf("Unbounded: the loop at 0x%03x-0x%03x %s\n", l->start, l->end, w.reason);
+    }
+
+    for (i = 0; i < w.loop_count; i++)
+    {
+        free(w.loops[i].exits);
+    }
+    free(w.prog);
+    free(w.loop_at);
+    free(w.loops);
+    free(w.stores);
+    free(w.targets);
+    free(w.dist);
+    free(nodes);
+    return !bounded;
+}
+
+/* ------------------------------------------- */
+/* ---------------- GENERATOR ---------------- */
+/* ------------------------------------------- */
+
+/* Synthetic sources for measuring the assembler. A label starts every gap
+ * lines, instructions refer to the next label, the last one or one at
+ * random, and a share of the lines are number and character literals. */
+
+enum reference_t {
+    REF_FORWARD,
+    REF_BACKWARD,
+    REF_RANDOM
+};
+
+typedef struct {
+    long lines;
+    long gap;  /* lines per label, 0 for none */
+    enum reference_t refs;
+    int literals;  /* percent of lines */
+    unsigned long rng;
+} generator_t;
+
+unsigned long generator_random(generator_t *g)
+{
+    /* xorshift64 */
+    g->rng ^= g->rng << 13;
+    g->rng ^= g->rng >> 7;
+    g->rng ^= g->rng << 17;
+    return g->rng;
+}
+
+void generate_source(generator_t *g, text_t *out)
+{
+    long labels = g->gap > 0 ? g->lines / g->gap : 0;
+    long placed = 0;
+    long target;
+    long i;
+    int r;
+    for (i = 0; i < g->lines; i++)
+    {
+        if (placed < labels && i % g->gap == 0)
+        {
+            out->size += snprintf(text_reserve(out, 32), 32, ":L%ld\n", placed++);
+            continue;
+        }
+        r = generator_random(g) % 100;
+        if (r < g->literals)
+        {
+            if (r % 4 == 0)
+            {
+                out->size += snprintf(text_reserve(out, 32), 32, "$%c\n",
+                    'a' + (int) (generator_random(g) % 26));
+            }
+            else
+            {
+                out->size += snprintf(text_reserve(out, 32), 32, "#%ld\n",
+                    (long) (generator_random(g) % 0x10000));
+            }
+        }
+        else if (r == 99)
+        {
+            out->size += snprintf(text_reserve(out, 32), 32, "STP\n");
+        }
+        else if (labels == 0)
+        {
+            out->size += snprintf(text_reserve(out, 32), 32, "%s 0x%03lx\n",
+                opcode_str[r % STP], generator_random(g) % IO_ADDRESS);
+        }
+        else
+        {
+            switch (g->refs)
+            {
+                case REF_FORWARD:
+                    target = placed < labels ? placed : labels - 1;
+                    break;
+                case REF_BACKWARD:
+                    target = placed > 0 ? placed - 1 : 0;
+                    break;
+                default:
+                    target = generator_random(g) % labels;
+                    break;
+            }
+            out->size += snprintf(text_reserve(out, 48), 48, "%s :L%ld\n",
+                opcode_str[r % STP], target);
+        }
+    }
+}
+
+enum reference_t reference_pattern(const char *s)
+{
+    if (s == NULL || !strcmp(s, "random"))
+    {
+        return REF_RANDOM;
+    }
+    if (!strcmp(s, "forward"))
+    {
+        return REF_FORWARD;
+    }
+    if (!strcmp(s, "backward"))
+    {
+        return REF_BACKWARD;
+    }
+    fprintf(stderr, "Unknown reference pattern %s\n", s);
+    exit(1);
+}
+
+/* Assembles generated sources of 1000 lines and ten times more each step up
+ * to max lines, each in its own process so its peak memory is its own.
+ * Stops growing once a step takes longer than budget seconds. */
+void benchmark_assembler(generator_t *g, long max, int budget, int extended)
+{
+    label_arena_t arena = {0};
+    text_t source = {0};
+    text_t out = {0};
+    source_t src;
+    struct rusage usage;
+    unsigned long start;
+    unsigned long taken;
+    unsigned long seed = g->rng;
+    pid_t pid;
+    int status;
+
+    build_opcode_table();
+    if (max > IO_ADDRESS + 1)
+    {
+        /* labels past 0xfff no longer fit in an operand */
+        printf("Sources over %d lines are a throughput test only, their images are not valid\n",
+            IO_ADDRESS + 1);
+    }
+    printf("%10s %8s %12s %10s %12s %10s\n", "lines", "labels", "bytes", "seconds",
+        "lines/s", "peak MiB");
+    fflush(stdout);
+    for (g->lines = 1000; g->lines <= max; g->lines *= 10)
+    {
+        start = monotonic_time();
+        pid = fork();
+        if (pid == 0)
+        {
+            g->rng = seed;
+            generate_source(g, &source);
+            src.data = source.data;
+            src.size = source.size;
+            src.mapped = 0;
+            start = monotonic_time();
+            assemble_source(&src, &arena, &out, "benchmark", 0, extended);
+            taken = monotonic_time() - start;
+            getrusage(RUSAGE_SELF, &usage);
+            printf("%10ld %8ld %12zu %10.3f %12.0f %10.1f\n", g->lines,
+                g->gap > 0 ? g->lines / g->gap : 0, source.size, taken / 1e9,
+                g->lines / (taken / 1e9), usage.ru_maxrss / 1024.0);
+            exit(0);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+        {
+            fprintf(stderr, "Benchmark of %ld lines failed\n", g->lines);
+            exit(1);
+        }
+        if (monotonic_time() - start > budget * 1000000000ul && g->lines < max)
+        {
+            printf("Stopping, %ld lines took over %d seconds\n", g->lines, budget);
+            break;
+        }
+    }
+}
+
+/* ------------------------------------------- */
+/* --------------- DISASSEMBLER -------------- */
+/* ------------------------------------------- */
+
+/* Words reachable from address 0 are written as instructions and the rest
+ * as numbers. Jump targets get L labels and other addresses instructions
+ * refer to get D labels, each named after its address, and numbers keep
+ * their full width, so the text assembles back to the same image. */
+
+#define DIS_CODE 1
+#define DIS_LABEL 2
+#define DIS_GAP 4
+
+/* Returns if the operand of op is an address rather than a number */
+int refers_to_memory(enum opcode_t op)
+{
+    return op != STP && op != LDI && op != SHL && op != SHR;
+}
+
+/* Reads the hex words of an image as written, with present marking the
+ * ones the file gave rather than skipped over with an "@address count"
+ * line. Returns the number of words, or -1 if it is not an image. */
+int read_words(source_t *src, unsigned long **words, unsigned char **present)
+{
+    const char *p = src->data;
+    const char *end = src->data + src->size;
+    unsigned long *w;
+    unsigned char *given;
+    unsigned long value;
+    int n = 0;
+    int at = 0;
+    int cap = 1024;
+    int digits;
+    int header;
+
+    w = malloc(cap * sizeof(unsigned long));
+    given = malloc(cap);
+    while (w != NULL && given != NULL)
+    {
+        while (p < end && isspace((unsigned char) *p))
+        {
+            p++;
+        }
+        if (p == end)
+        {
+            break;
+        }
+        header = *p == SEGMENT_C;
+        p += header;
+        value = 0;
+        for (digits = 0; p < end && isxdigit((unsigned char) *p); p++, digits++)
+        {
+            value = value << 4 | (isdigit((unsigned char) *p) ? *p - '0'
+                : tolower((unsigned char) *p) - 'a' + 10);
+        }
+        if (digits == 0 || (p < end && !isspace((unsigned char) *p))
+            || (header && value > IO_ADDRESS))
+        {
+            free(w);
+            free(given);
+            return -1;
+        }
+        if (header)
+        {
+            /* the count is not needed to place the words */
+            at = value;
+            p = skip_token(skip_space(p, end), end);
+            continue;
+        }
+        if (at >= cap)
+        {
+            cap = 2 * at;
+            w = realloc(w, cap * sizeof(unsigned long));
+            given = realloc(given, cap);
+            if (w == NULL || given == NULL)
+            {
+                break;
+            }
+        }
+        for (; n < at; n++)
+        {
+            w[n] = 0;
+            given[n] = 0;
+        }
+        w[at] = value;
+        given[at++] = 1;
+        n = at > n ? at : n;
+    }
+    if (w == NULL || given == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    *words = w;
+    *present = given;
+    return n;
+}
+
+char label_kind(unsigned char *flags, int address)
+{
+    return flags[address] & DIS_CODE ? 'L' : 'D';
+}
+
+void disassemble_words(unsigned long *words, unsigned char *present, int n, text_t *out,
+    int extended)
+{
+    unsigned char *flags = calloc(n + 1, 1);
+    int *stack = malloc((2 * n + 2) * sizeof(int));
+    int top = 0;
+    int addr;
+    int next;
+    int word;
+    int op;
+    int operand;
+    if (flags == NULL || stack == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    /* follow the control flow from address 0 */
+    if (n > 0)
+    {
+        stack[top++] = 0;
+    }
+    while (top > 0)
+    {
+        addr = stack[--top];
+        word = words[addr] & 0xffff;
+        if (flags[addr] & DIS_CODE || !decodable(word, extended))
+        {
+            continue;
+        }
+        flags[addr] |= DIS_CODE;
+        op = get_opcode(word);
+        if ((op == JMP || op == JGE || op == JNE) && get_operand(word) < n)
+        {
+            stack[top++] = get_operand(word);
+        }
+        if (op != JMP && op != STP && addr + 1 < n)
+        {
+            stack[top++] = addr + 1;
+        }
+    }
+    /* the operands of code name labels, including one just past the end */
+    for (addr = 0; addr < n; addr++)
+    {
+        word = words[addr] & 0xffff;
+        operand = get_operand(word);
+        if (flags[addr] & DIS_CODE && refers_to_memory(get_opcode(word))
+            && operand <= n && operand != IO_ADDRESS)
+        {
+            flags[operand] |= DIS_LABEL;
+        }
+    }
+    for (addr = 0; addr < n; addr++)
+    {
+        flags[addr] |= present[addr] ? 0 : DIS_GAP;
+    }
+    out->size = 0;
+    for (addr = 0; addr <= n; addr++)
+    {
+        for (next = addr; next < n && flags[next] & DIS_GAP; next++)
+        {
+            if (flags[next] & DIS_LABEL)
+            {
+                /* a label in a gap only needs its address, not a word */
+                out->size += snprintf(text_reserve(out, 32), 32, ".org 0x%03x\n:%c%03x\n", next,
+                    label_kind(flags, next), next);
+            }
+        }
+        if (next > addr)
+        {
+            /* words the image skipped over are skipped over again */
+            out->size += snprintf(text_reserve(out, 16), 16, ".org 0x%03x\n", next);
+            addr = next;
+        }
+        if (flags[addr] & DIS_LABEL)
+        {
+            out->size += snprintf(text_reserve(out, 16), 16, ":%c%03x\n",
+                label_kind(flags, addr), addr);
+        }
+        if (addr == n)
+        {
+            break;
+        }
+        word = words[addr];
+        op = get_opcode(word);
+        operand = get_operand(word);
+        if (!(flags[addr] & DIS_CODE) || words[addr] > 0xffff)
+        {
+            /* as written, so wide numbers come back out the same */
+            out->size += snprintf(text_reserve(out, 32), 32,
+                words[addr] >= 0x8000 && words[addr] <= 0xffff ? "#0x%04lx\n" : "#%ld\n", (long) words[addr]);
+        }
+        else if (op == STP && operand == 0)
+        {
+            out->size += snprintf(text_reserve(out, 16), 16, "STP\n");
+        }
+        else if (refers_to_memory(op) && operand <= n && operand != IO_ADDRESS)
+        {
+            out->size += snprintf(text_reserve(out, 16), 16, "%s :%c%03x\n", opcode_str[op],
+                label_kind(flags, operand), operand);
+        }
+        else
+        {
+            out->size += snprintf(text_reserve(out, 16), 16, "%s 0x%03x\n", opcode_str[op],
+                operand);
+        }
+    }
+    free(flags);
+    free(stack);
+}
+
+int disassemble_file(assembly_job_t *job, label_arena_t *arena, text_t *out, int verbose,
+    int extended)
+{
+    FILE *f;
+    source_t *src;
+    unsigned long *words;
+    unsigned char *present;
+    int n;
+
+    f = fopen(job->input, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", job->input);
+        return 0;
+    }
+    src = open_source(f);
+    fclose(f);
+    n = read_words(src, &words, &present);
+    close_source(src);
+    if (n < 0)
+    {
+        fprintf(stderr, "%s: Not a machine code file\n", job->input);
+        return 0;
+    }
+    disassemble_words(words, present, n, out, extended);
+    free(words);
+    free(present);
+    f = fopen(job->output, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", job->output);
+        return 0;
+    }
+    fwrite(out->data, 1, out->size, f);
+    fclose(f);
+    return 1;
+}
+
+/* ------------------------------------------- */
+/* -------------- SUPEROPTIMISER ------------- */
+/* ------------------------------------------- */
+
+/* Searches for the shortest sequence of LDA, STO, ADD and SUB on the cells
+ * of a given sequence and some scratch cells that leaves the accumulator and
+ * the named cells as the sequence does. Each length is searched in turn,
+ * split between threads by the first instruction. A candidate is run on a
+ * batch of random states at once, and one that matches them all is proved
+ * by running both sequences on symbols: the accumulator is a sum of atoms,
+ * which are the inputs and what loading the low 16 bits of a sum gives, so
+ * equal sums are equal for every input. */
+
+#define SUPEROPT_CELLS 16
+#define SUPEROPT_LENGTH 32
+#define SUPEROPT_LANES 16
+#define SUPEROPT_ATOMS (1 + SUPEROPT_CELLS + 2 * SUPEROPT_LENGTH)
+
+typedef struct {
+    uint32_t ACC[SUPEROPT_LANES];
+    uint16_t cells[SUPEROPT_CELLS][SUPEROPT_LANES];
+} lanes_t;
+
+/* The inputs are ACC then each cell, and a cell holds a sum of them */
+typedef struct {
+    int count;
+    uint16_t low[SUPEROPT_ATOMS][SUPEROPT_CELLS + 1];  /* low 16 bits of each atom */
+} atoms_t;
+
+typedef struct {
+    uint32_t ACC[SUPEROPT_ATOMS];
+    uint16_t cells[SUPEROPT_CELLS][SUPEROPT_CELLS + 1];
+} symbols_t;
+
+typedef struct {
+    char *names[SUPEROPT_CELLS];
+    int cells;  /* named cells then scratch cells */
+    int named;
+    int target[SUPEROPT_LENGTH];  /* opcode * cells + cell */
+    int length;
+    lanes_t start;
+    lanes_t expected;
+    int search;  /* length being searched */
+    int next;  /* next first instruction to search from */
+    int first;  /* lowest first instruction of an answer */
+    int answer[SUPEROPT_LENGTH];
+    long tried;
+    pthread_mutex_t lock;
+} superopt_t;
+
+void step_lanes(lanes_t *s, int op, int cell)
+{
+    int i;
+    switch (op)
+    {
+        case LDA:
+            for (i = 0; i < SUPEROPT_LANES; i++)
+            {
+                s->ACC[i] = (int16_t) s->cells[cell][i];
+            }
+            break;
+        case STO:
+            for (i = 0; i < SUPEROPT_LANES; i++)
+            {
+                s->cells[cell][i] = s->ACC[i];
+            }
+            break;
+        case ADD:
+            for (i = 0; i < SUPEROPT_LANES; i++)
+            {
+                s->ACC[i] = (int16_t) (s->ACC[i] + (int16_t) s->cells[cell][i]);
+            }
+            break;
+        default:
+            for (i = 0; i < SUPEROPT_LANES; i++)
+            {
+                s->ACC[i] = (int16_t) (s->ACC[i] - (int16_t) s->cells[cell][i]);
+            }
+            break;
+    }
+}
+
+/* Returns the atom for loading a cell holding low */
+int find_atom(atoms_t *a, const uint16_t *low)
+{
+    int i;
+    /* atom 0 is all of ACC, so even its low 16 bits loaded back differ */
+    for (i = 1; i < a->count; i++)
+    {
+        if (!memcmp(a->low[i], low, sizeof(a->low[0])))
+        {
+            return i;
+        }
+    }
+    memcpy(a->low[a->count], low, sizeof(a->low[0]));
+    return a->count++;
+}
+
+void step_symbols(atoms_t *a, symbols_t *s, int op, int cell)
+{
+    uint16_t sum;
+    int i;
+    int j;
+    switch (op)
+    {
+        case LDA:
+            memset(s->ACC, 0, sizeof(s->ACC));
+            s->ACC[find_atom(a, s->cells[cell])] = 1;
+            break;
+        case STO:
+            for (j = 0; j < SUPEROPT_CELLS + 1; j++)
+            {
+                for (sum = 0, i = 0; i < a->count; i++)
+                {
+                    sum += s->ACC[i] * a->low[i][j];
+                }
+                s->cells[cell][j] = sum;
+            }
+            break;
+        case ADD:
+            s->ACC[find_atom(a, s->cells[cell])]++;
+            break;
+        default:
+            s->ACC[find_atom(a, s->cells[cell])]--;
+            break;
+    }
+}
+
+void start_symbols(symbols_t *s)
+{
+    int i;
+    memset(s, 0, sizeof(symbols_t));
+    s->ACC[0] = 1;
+    for (i = 0; i < SUPEROPT_CELLS; i++)
+    {
+        s->cells[i][i + 1] = 1;
+    }
+}
+
+/* Returns if the candidate is equal to the target for every input */
+int proved(superopt_t *sup, const int *candidate, int length)
+{
+    atoms_t atoms;
+    symbols_t want;
+    symbols_t got;
+    int i;
+
+    memset(&atoms, 0, sizeof(atoms));
+    for (i = 0; i <= SUPEROPT_CELLS; i++)
+    {
+        atoms.low[i][i] = 1;
+    }
+    atoms.count = SUPEROPT_CELLS + 1;
+    start_symbols(&want);
+    start_symbols(&got);
+    for (i = 0; i < sup->length; i++)
+    {
+        step_symbols(&atoms, &want, sup->target[i] / sup->cells, sup->target[i] % sup->cells);
+    }
+    for (i = 0; i < length; i++)
+    {
+        step_symbols(&atoms, &got, candidate[i] / sup->cells, candidate[i] % sup->cells);
+    }
+    return !memcmp(want.ACC, got.ACC, sizeof(want.ACC))
+        && !memcmp(want.cells, got.cells, sup->named * sizeof(want.cells[0]));
+}
+
+int written(superopt_t *sup, const int *candidate, int depth, int cell)
+{
+    int i;
+    for (i = 0; i < depth; i++)
+    {
+        if (candidate[i] == STO * sup->cells + cell)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns if an instruction after the ones before it can be left out, or
+ * makes one before it unneeded, so a shorter sequence does the same, or if
+ * the same sequence is tried in another order or with other scratch cells */
+int pruned(superopt_t *sup, const int *candidate, int depth, int op, int cell)
+{
+    int last_op = candidate[depth - 1] / sup->cells;
+    int last_cell = candidate[depth - 1] % sup->cells;
+    if (op == LDA && last_op != STO)
+    {
+        return 1;
+    }
+    /* scratch cells are written before they are read, and first written in order */
+    if (cell >= sup->named && !written(sup, candidate, depth, cell)
+        && (op != STO || (cell > sup->named && !written(sup, candidate, depth, cell - 1))))
+    {
+        return 1;
+    }
+    if ((op == ADD || op == SUB) && (last_op == ADD || last_op == SUB)
+        && op * sup->cells + cell < candidate[depth - 1])
+    {
+        return 1;
+    }
+    if (op == STO && last_op == STO && cell == last_cell)
+    {
+        return 1;
+    }
+    if ((op == ADD && last_op == SUB) || (op == SUB && last_op == ADD))
+    {
+        return cell == last_cell;
+    }
+    return op == STO && cell >= sup->named && depth == sup->search - 1;
+}
+
+/* Tries every way to finish the candidate. Returns if one is an answer. */
+int extend(superopt_t *sup, lanes_t *states, int *candidate, int depth, long *tried)
+{
+    int code;
+    int op;
+    int cell;
+    if (depth == sup->search)
+    {
+        (*tried)++;
+        return !memcmp(states[depth].ACC, sup->expected.ACC, sizeof(sup->expected.ACC))
+            && !memcmp(states[depth].cells, sup->expected.cells,
+                sup->named * sizeof(sup->expected.cells[0]))
+            && proved(sup, candidate, depth);
+    }
+    for (code = 0; code < 4 * sup->cells; code++)
+    {
+        if (depth == 1 && __atomic_load_n(&sup->first, __ATOMIC_RELAXED) < candidate[0])
+        {
+            return 0;
+        }
+        op = code / sup->cells;
+        cell = code % sup->cells;
+        if (pruned(sup, candidate, depth, op, cell))
+        {
+            continue;
+        }
+        states[depth + 1] = states[depth];
+        step_lanes(&states[depth + 1], op, cell);
+        candidate[depth] = code;
+        if (extend(sup, states, candidate, depth + 1, tried))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void *superopt_worker(void *arg)
+{
+    superopt_t *sup = arg;
+    lanes_t states[SUPEROPT_LENGTH + 1];
+    int candidate[SUPEROPT_LENGTH];
+    long tried = 0;
+    int first;
+    while ((first = __atomic_fetch_add(&sup->next, 1, __ATOMIC_RELAXED)) < 4 * sup->cells
+        && first < __atomic_load_n(&sup->first, __ATOMIC_RELAXED))
+    {
+        /* only the first scratch cell can be written first */
+        if (first % sup->cells >= sup->named
+            && (first / sup->cells != STO || sup->search == 1 || first % sup->cells > sup->named))
+        {
+            continue;
+        }
+        states[0] = sup->start;
+        states[1] = sup->start;
+        step_lanes(&states[1], first / sup->cells, first % sup->cells);
+        candidate[0] = first;
+        if (extend(sup, states, candidate, 1, &tried))
+        {
+            pthread_mutex_lock(&sup->lock);
+            if (first < sup->first)
+            {
+                sup->first = first;
+                memcpy(sup->answer, candidate, sup->search * sizeof(int));
+            }
+            pthread_mutex_unlock(&sup->lock);
+        }
+    }
+    __atomic_fetch_add(&sup->tried, tried, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* Reads the sequence to shorten, giving its cells names as written */
+void read_sequence(superopt_t *sup, const char *name)
+{
+    FILE *f;
+    source_t *src;
+    const char *line;
+    const char *eol;
+    const char *end;
+    const char *word;
+    const char *word_end;
+    char operand[32];
+    int line_number = 0;
+    int op;
+    int cell;
+
+    f = fopen(name, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", name);
+        exit(1);
+    }
+    src = open_source(f);
+    fclose(f);
+    end = src->data + src->size;
+    for (line = src->data; line < end; line = eol)
+    {
+        eol = next_line(line, end);
+        line_number++;
+        word = skip_space(line, eol);
+        word_end = skip_token(word, eol);
+        if (word == word_end || *word == COMMENT_C)
+        {
+            continue;
+        }
+        for (op = 0; op < 4; op++)
+        {
+            if (word_end - word == 3 && !strncmp(word, opcode_str[op], 3))
+            {
+                break;
+            }
+        }
+        word = skip_space(word_end, eol);
+        word_end = skip_token(word, eol);
+        if (op == 4 || word == word_end)
+        {
+            fprintf(stderr, "%s:%d: Only LDA, STO, ADD and SUB of a cell can be optimised\n",
+                name, line_number);
+            exit(1);
+        }
+        if (*word == ':')
+        {
+            snprintf(operand, sizeof(operand), "%.*s", (int) (word_end - word), word);
+        }
+        else if (parse_number(word, word_end) >= ARITH_ADDRESS)
+        {
+            fprintf(stderr, "%s:%d: 0x%03lx is not a memory cell\n", name, line_number,
+                parse_number(word, word_end));
+            exit(1);
+        }
+        else
+        {
+            snprintf(operand, sizeof(operand), "0x%03lx", parse_number(word, word_end) & 0xfff);
+        }
+        for (cell = 0; cell < sup->named && strcmp(sup->names[cell], operand); cell++)
+        {
+        }
+        if (cell == sup->named)
+        {
+            if (sup->named == SUPEROPT_CELLS)
+            {
+                fprintf(stderr, "%s: More than %d cells\n", name, SUPEROPT_CELLS);
+                exit(1);
+            }
+            sup->names[sup->named++] = strdup(operand);
+        }
+        if (sup->length == SUPEROPT_LENGTH)
+        {
+            fprintf(stderr, "%s: More than %d instructions\n", name, SUPEROPT_LENGTH);
+            exit(1);
+        }
+        sup->target[sup->length++] = op * SUPEROPT_CELLS + cell;
+    }
+    close_source(src);
+}
+
+/* Prints the shortest sequence that does what the one in file name does.
+ * Returns zero, or one if there is none shorter. */
+int superopt(const char *name, int scratch, int max, int threads, unsigned long seed, int verbose)
+{
+    superopt_t sup;
+    pthread_t *workers;
+    static const uint32_t edges[] = {0, 0xffffffff, 0x8000, 0x7fff};
+    unsigned long r = seed ? seed : 0x2545f4914f6cdd1d;
+    uint32_t value;
+    int i;
+    int j;
+
+    memset(&sup, 0, sizeof(sup));
+    read_sequence(&sup, name);
+    if (sup.named + scratch > SUPEROPT_CELLS)
+    {
+        fprintf(stderr, "More than %d cells with the scratch cells\n", SUPEROPT_CELLS);
+        exit(1);
+    }
+    sup.cells = sup.named + scratch;
+    for (i = 0; i < sup.length; i++)
+    {
+        sup.target[i] = sup.target[i] / SUPEROPT_CELLS * sup.cells + sup.target[i] % SUPEROPT_CELLS;
+    }
+    /* the first lanes hold edge cases and the rest random states */
+    for (i = 0; i < SUPEROPT_LANES; i++)
+    {
+        for (j = -1; j < sup.cells; j++)
+        {
+            /* xorshift64 */
+            r ^= r << 13;
+            r ^= r >> 7;
+            r ^= r << 17;
+            value = i < 4 ? edges[i] : r;
+            if (j < 0)
+            {
+                sup.start.ACC[i] = (int16_t) value;
+            }
+            else
+            {
+                sup.start.cells[j][i] = value;
+            }
+        }
+    }
+    sup.expected = sup.start;
+    for (i = 0; i < sup.length; i++)
+    {
+        step_lanes(&sup.expected, sup.target[i] / sup.cells, sup.target[i] % sup.cells);
+    }
+    workers = malloc(threads * sizeof(pthread_t));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    pthread_mutex_init(&sup.lock, NULL);
+    sup.first = INT_MAX;
+    max = max < sup.length ? max : sup.length - 1;
+    for (sup.search = 0; sup.search <= max && sup.first == INT_MAX; sup.search++)
+    {
+        sup.next = 0;
+        sup.tried = 0;
+        if (sup.search == 0)
+        {
+            sup.first = proved(&sup, NULL, 0) ? 0 : INT_MAX;
+        }
+        else if (threads <= 1)
+        {
+            superopt_worker(&sup);
+        }
+        else
+        {
+            for (i = 0; i < threads; i++)
+            {
+                if (pthread_create(&workers[i], NULL, superopt_worker, &sup) != 0)
+                {
+                    fprintf(stderr, "Could not start worker %d\n", i);
+                    exit(1);
+                }
+            }
+            for (i = 0; i < threads; i++)
+            {
+                pthread_join(workers[i], NULL);
+            }
+        }
+        if (verbose)
+        {
+            printf("; Searched length %d: %ld candidates\n", sup.search, sup.tried);
+        }
+    }
+    free(workers);
+    pthread_mutex_destroy(&sup.lock);
+    if (sup.first == INT_MAX)
+    {
+        printf("; No sequence of %d instructions or fewer\n", max);
+        return 1;
+    }
+    sup.search--;
+    printf("; %d instructions (%d cycles) become %d (%d cycles)\n", sup.length, 2 * sup.length,
+        sup.search, 2 * sup.search);
+    for (i = 0; i < sup.search; i++)
+    {
+        j = sup.answer[i] % sup.cells;
+        if (j < sup.named)
+        {
+            printf("%s %s\n", opcode_str[sup.answer[i] / sup.cells], sup.names[j]);
+        }
+        else
+        {
+            printf("%s :scratch%d\n", opcode_str[sup.answer[i] / sup.cells], j - sup.named);
+        }
+    }
+    for (i = 0; i < sup.named; i++)
+    {
+        free(sup.names[i]);
+    }
+    return 0;
+}
+
+/* ------------------------------------------- */
+/* ----------------- COMPILER ---------------- */
+/* ------------------------------------------- */
+
+/* Compiles a small language to assembly:
+ *
+ *     var n = 10, a[16];
+ *     while n > 0 { n = n - 1; a[n] = in; }
+ *     if a[0] == 'q' { out 'y'; } else { stop; }
+ *
+ * Variables are 16 bit memory cells, declared with var or by being used,
+ * and in and out read and write 0xfff. Expressions are kept as trees so
+ * constants fold and operands that are already in memory are added in
+ * place. Loops test at the bottom, conditions become one JGE or JNE where
+ * they can, and temporaries are a stack of cells reused by each statement.
+ * Arrays are indexed by patching a LDA or STO, or with LDN and STN with -x. */
+
+#define NAME_LENGTH 32
+
+enum node_kind_t {
+    N_NUMBER,
+    N_IN,
+    N_VARIABLE,
+    N_INDEX,
+    N_ADD,
+    N_SUB,
+    N_AND,
+    N_MUL,
+    N_SHL,
+    N_SHR
+};
+
+enum relation_t {
+    R_GE,
+    R_LT,
+    R_GT,
+    R_LE,
+    R_NE,
+    R_EQ
+};
+
+typedef struct node {
+    enum node_kind_t kind;
+    long value;  /* number, or the variable */
+    struct node *left;
+    struct node *right;  /* also the index */
+    struct node *next;  /* all nodes, to free them */
+} node_t;
+
+typedef struct {
+    enum relation_t relation;
+    node_t *left;
+    node_t *right;
+} condition_t;
+
+typedef struct {
+    char name[NAME_LENGTH];
+    long *values;  /* NULL for zeros */
+    int size;  /* 0 for a variable */
+} variable_t;
+
+typedef struct {
+    const char *name;
+    const char *p;
+    const char *end;
+    int line;
+    char token[NAME_LENGTH];
+    long number;  /* if the token is a number */
+    int extended;
+    text_t out;
+    variable_t *variables;
+    int count;
+    int capacity;
+    long *constants;
+    int constant_count;
+    int constant_capacity;
+    int labels;
+    int temps;  /* in use */
+    int max_temps;
+    node_t *nodes;
+} compiler_t;
+
+void compile_error(compiler_t *c, const char *message)
+{
+    fprintf(stderr, "%s:%d: %s\n", c->name, c->line, message);
+    exit(1);
+}
+
+void emit(compiler_t *c, const char *format, ...)
+{
+    va_list args;
+    char *buf = text_reserve(&c->out, 128);
+    va_start(args, format);
+    c->out.size += vsnprintf(buf, 128, format, args);
+    va_end(args);
+}
+
+/* Reads the next token: a name, a number, a character or an operator.
+ * The token is empty at the end of the source. */
+void next_token(compiler_t *c)
+{
+    const char *start;
+    for (;;)
+    {
+        while (c->p < c->end && isspace((unsigned char) *c->p))
+        {
+            c->line += *c->p++ == '\n';
+        }
+        if (c->p + 1 < c->end && c->p[0] == '/' && c->p[1] == '/')
+        {
+            c->p = next_line(c->p, c->end);
+            c->line++;
+            continue;
+        }
+        break;
+    }
+    start = c->p;
+    if (c->p == c->end)
+    {
+        c->token[0] = '\0';
+        return;
+    }
+    if (isalnum((unsigned char) *c->p) || *c->p == '_')
+    {
+        while (c->p < c->end && (isalnum((unsigned char) *c->p) || *c->p == '_'))
+        {
+            c->p++;
+        }
+        if (isdigit((unsigned char) *start))
+        {
+            c->number = parse_number(start, c->p);
+        }
+    }
+    else if (*c->p == '\'')
+    {
+        if (c->p + 2 < c->end && c->p[1] == '\\' && c->p + 3 < c->end && c->p[3] == '\'')
+        {
+            c->number = c->p[2] == 'n' ? '\n' : c->p[2] == 't' ? '\t' : c->p[2] == '0' ? 0 : c->p[2];
+            c->p += 4;
+        }
+        else if (c->p + 2 < c->end && c->p[2] == '\'')
+        {
+            c->number = (unsigned char) c->p[1];
+            c->p += 3;
+        }
+        else
+        {
+            compile_error(c, "Bad character literal");
+        }
+        strcpy(c->token, "0");
+        return;
+    }
+    else if (c->p + 1 < c->end && strchr("=!<>", c->p[0]) != NULL
+        && (c->p[1] == '=' || (c->p[0] == c->p[1] && c->p[0] != '=' && c->p[0] != '!')))
+    {
+        c->p += 2;
+    }
+    else
+    {
+        c->p++;
+    }
+    if (c->p - start >= NAME_LENGTH)
+    {
+        compile_error(c, "Name too long");
+    }
+    memcpy(c->token, start, c->p - start);
+    c->token[c->p - start] = '\0';
+}
+
+int is_token(compiler_t *c, const char *token)
+{
+    return !strcmp(c->token, token);
+}
+
+int is_number(compiler_t *c)
+{
+    return isdigit((unsigned char) c->token[0]);
+}
+
+int is_name(compiler_t *c)
+{
+    return isalpha((unsigned char) c->token[0]);
+}
+
+void expect_token(compiler_t *c, const char *token)
+{
+    char message[64];
+    if (!is_token(c, token))
+    {
+        snprintf(message, sizeof(message), "Expected %s", token);
+        compile_error(c, message);
+    }
+    next_token(c);
+}
+
+int find_variable(compiler_t *c, const char *name)
+{
+    int i;
+    for (i = 0; i < c->count; i++)
+    {
+        if (!strcmp(c->variables[i].name, name))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int add_variable(compiler_t *c, const char *name, int size, long *values)
+{
+    if (c->count == c->capacity)
+    {
+        c->capacity = c->capacity ? 2 * c->capacity : 64;
+        c->variables = realloc(c->variables, c->capacity * sizeof(variable_t));
+        if (c->variables == NULL)
+        {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
+    }
+    strcpy(c->variables[c->count].name, name);
+    c->variables[c->count].size = size;
+    c->variables[c->count].values = values;
+    return c->count++;
+}
+
+/* Returns the label of a cell holding value */
+const char *constant(compiler_t *c, long value, char *buf)
+{
+    int i;
+    value = (int16_t) value;
+    for (i = 0; i < c->constant_count && c->constants[i] != value; i++)
+    {
+    }
+    if (i == c->constant_count)
+    {
+        if (c->constant_count == c->constant_capacity)
+        {
+            c->constant_capacity = c->constant_capacity ? 2 * c->constant_capacity : 64;
+            c->constants = realloc(c->constants, c->constant_capacity * sizeof(long));
+            if (c->constants == NULL)
+            {
+                fprintf(stderr, "Memory allocation error\n");
+                exit(1);
+            }
+        }
+        c->constants[c->constant_count++] = value;
+    }
+    sprintf(buf, value < 0 ? ":_km%ld" : ":_k%ld", labs(value));
+    return buf;
+}
+
+node_t *new_node(compiler_t *c, enum node_kind_t kind, long value, node_t *left, node_t *right)
+{
+    node_t *n = malloc(sizeof(node_t));
+    if (n == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    n->kind = kind;
+    n->value = value;
+    n->left = left;
+    n->right = right;
+    n->next = c->nodes;
+    c->nodes = n;
+    return n;
+}
+
+node_t *number(compiler_t *c, long value)
+{
+    return new_node(c, N_NUMBER, value, NULL, NULL);
+}
+
+/* Makes left kind right, folding constants */
+node_t *binary(compiler_t *c, enum node_kind_t kind, node_t *left, node_t *right)
+{
+    node_t *swap;
+    long a;
+    long b;
+    if (left->kind == N_NUMBER && right->kind == N_NUMBER)
+    {
+        a = left->value;
+        b = right->value;
+        switch (kind)
+        {
+            case N_ADD: return number(c, a + b);
+            case N_SUB: return number(c, a - b);
+            case N_AND: return number(c, a & b);
+            case N_MUL: return number(c, a * b);
+            case N_SHL: return number(c, a << (b & 31));
+            default: return number(c, a >> (b & 31));
+        }
+    }
+    if ((kind == N_ADD || kind == N_AND || kind == N_MUL) && left->kind == N_NUMBER)
+    {
+        swap = left;
+        left = right;
+        right = swap;
+    }
+    if (kind == N_MUL && right->kind != N_NUMBER)
+    {
+        compile_error(c, "Can only multiply by a number");
+    }
+    if ((kind == N_SHL || kind == N_SHR) && right->kind != N_NUMBER)
+    {
+        compile_error(c, "Can only shift by a number");
+    }
+    if (right->kind != N_NUMBER || (kind != N_ADD && kind != N_SUB))
+    {
+        return new_node(c, kind, 0, left, right);
+    }
+    /* x + a + b and x - a + b need one constant, and a - x - b too */
+    b = kind == N_ADD ? right->value : -right->value;
+    if ((left->kind == N_ADD || left->kind == N_SUB) && left->right->kind == N_NUMBER)
+    {
+        a = left->kind == N_ADD ? left->right->value : -left->right->value;
+        return binary(c, N_ADD, left->left, number(c, a + b));
+    }
+    if (left->kind == N_SUB && left->left->kind == N_NUMBER)
+    {
+        return binary(c, N_SUB, number(c, left->left->value + b), left->right);
+    }
+    if (b == 0)
+    {
+        return left;
+    }
+    return new_node(c, b < 0 ? N_SUB : N_ADD, 0, left, number(c, labs(b)));
+}
+
+node_t *parse_expression(compiler_t *c);
+
+int is_keyword(const char *name)
+{
+    static const char *keywords[] = {"var", "while", "do", "if", "else", "out", "in", "stop", NULL};
+    int i;
+    for (i = 0; keywords[i] != NULL && strcmp(keywords[i], name); i++)
+    {
+    }
+    return keywords[i] != NULL;
+}
+
+int variable(compiler_t *c, const char *name)
+{
+    int v = find_variable(c, name);
+    if (is_keyword(name))
+    {
+        compile_error(c, "Unexpected keyword");
+    }
+    return v >= 0 ? v : add_variable(c, name, 0, NULL);
+}
+
+node_t *parse_primary(compiler_t *c)
+{
+    node_t *n;
+    int v;
+    char name[NAME_LENGTH];
+    if (is_number(c))
+    {
+        n = number(c, c->number);
+        next_token(c);
+    }
+    else if (is_token(c, "-"))
+    {
+        next_token(c);
+        n = binary(c, N_SUB, number(c, 0), parse_primary(c));
+    }
+    else if (is_token(c, "("))
+    {
+        next_token(c);
+        n = parse_expression(c);
+        expect_token(c, ")");
+    }
+    else if (is_token(c, "in"))
+    {
+        n = new_node(c, N_IN, 0, NULL, NULL);
+        next_token(c);
+    }
+    else if (is_name(c))
+    {
+        strcpy(name, c->token);
+        next_token(c);
+        if (is_token(c, "["))
+        {
+            next_token(c);
+            v = find_variable(c, name);
+            if (v < 0 || c->variables[v].size == 0)
+            {
+                compile_error(c, "Not an array");
+            }
+            n = new_node(c, N_INDEX, v, NULL, parse_expression(c));
+            expect_token(c, "]");
+        }
+        else
+        {
+            n = new_node(c, N_VARIABLE, variable(c, name), NULL, NULL);
+        }
+    }
+    else
+    {
+        compile_error(c, "Expected an expression");
+        n = NULL;
+    }
+    return n;
+}
+
+node_t *parse_term(compiler_t *c)
+{
+    node_t *n = parse_primary(c);
+    enum node_kind_t kind;
+    for (;;)
+    {
+        if (is_token(c, "*"))
+        {
+            kind = N_MUL;
+        }
+        else if (is_token(c, "<<") || is_token(c, ">>"))
+        {
+            if (!c->extended)
+            {
+                compile_error(c, "Shifts need -x");
+            }
+            kind = is_token(c, "<<") ? N_SHL : N_SHR;
+        }
+        else
+        {
+            return n;
+        }
+        next_token(c);
+        n = binary(c, kind, n, parse_primary(c));
+    }
+}
+
+node_t *parse_sum(compiler_t *c)
+{
+    node_t *n = parse_term(c);
+    enum node_kind_t kind;
+    while (is_token(c, "+") || is_token(c, "-"))
+    {
+        kind = is_token(c, "+") ? N_ADD : N_SUB;
+        next_token(c);
+        n = binary(c, kind, n, parse_term(c));
+    }
+    return n;
+}
+
+node_t *parse_expression(compiler_t *c)
+{
+    node_t *n = parse_sum(c);
+    while (is_token(c, "&"))
+    {
+        if (!c->extended)
+        {
+            compile_error(c, "& needs -x");
+        }
+        next_token(c);
+        n = binary(c, N_AND, n, parse_sum(c));
+    }
+    return n;
+}
+
+void parse_condition(compiler_t *c, condition_t *cond)
+{
+    static const char *relations[] = {">=", "<", ">", "<=", "!=", "=="};
+    int i;
+    cond->left = parse_expression(c);
+    for (i = 0; i < 6 && !is_token(c, relations[i]); i++)
+    {
+    }
+    if (i == 6)
+    {
+        /* a bare expression is true if it isn't zero */
+        cond->relation = R_NE;
+        cond->right = number(c, 0);
+        return;
+    }
+    next_token(c);
+    cond->relation = i;
+    cond->right = parse_expression(c);
+}
+
+/* ---- code generation ---- */
+
+int simple(node_t *n)
+{
+    return n->kind == N_NUMBER || n->kind == N_IN || n->kind == N_VARIABLE;
+}
+
+int uses_input(node_t *n)
+{
+    return n != NULL && (n->kind == N_IN || uses_input(n->left) || uses_input(n->right));
+}
+
+/* Returns the address operand of a simple node */
+const char *operand(compiler_t *c, node_t *n, char *buf)
+{
+    if (n->kind == N_NUMBER)
+    {
+        return constant(c, n->value, buf);
+    }
+    if (n->kind == N_IN)
+    {
+        return "0xfff";
+    }
+    sprintf(buf, ":%s", c->variables[n->value].name);
+    return buf;
+}
+
+int push_temp(compiler_t *c)
+{
+    if (++c->temps > c->max_temps)
+    {
+        c->max_temps = c->temps;
+    }
+    return c->temps - 1;
+}
+
+int new_label(compiler_t *c)
+{
+    return c->labels++;
+}
+
+void generate(compiler_t *c, node_t *n);
+
+/* Leaves the address of array element n in temp, or patches it into an
+ * instruction as the operand of op and returns that instruction's label */
+int element(compiler_t *c, node_t *n, const char *op, int temp)
+{
+    int label;
+    generate(c, n->right);
+    if (c->extended)
+    {
+        emit(c, "ADD :_l_%s\nSTO :_t%d\n", c->variables[n->value].name, temp);
+        return -1;
+    }
+    label = new_label(c);
+    emit(c, "ADD :_%c_%s\nSTO :_P%d\n", tolower((unsigned char) op[0]),
+        c->variables[n->value].name, label);
+    return label;
+}
+
+void generate_operation(compiler_t *c, const char *op, node_t *left, node_t *right)
+{
+    char buf[NAME_LENGTH + 8];
+    int commutes = strcmp(op, "SUB");
+    int t;
+    int u;
+    if (simple(right))
+    {
+        generate(c, left);
+        emit(c, "%s %s\n", op, operand(c, right, buf));
+    }
+    else if (commutes && simple(left) && !(uses_input(left) && uses_input(right)))
+    {
+        generate(c, right);
+        emit(c, "%s %s\n", op, operand(c, left, buf));
+    }
+    else if (uses_input(left) && uses_input(right))
+    {
+        /* keep reading the input in order */
+        t = push_temp(c);
+        generate(c, left);
+        emit(c, "STO :_t%d\n", t);
+        u = push_temp(c);
+        generate(c, right);
+        emit(c, "STO :_t%d\nLDA :_t%d\n%s :_t%d\n", u, t, op, u);
+        c->temps -= 2;
+    }
+    else
+    {
+        generate(c, right);
+        t = push_temp(c);
+        emit(c, "STO :_t%d\n", t);
+        generate(c, left);
+        emit(c, "%s :_t%d\n", op, t);
+        c->temps--;
+    }
+}
+
+void generate_multiply(compiler_t *c, node_t *x, long k)
+{
+    char buf[NAME_LENGTH + 8];
+    const char *source;
+    int bit;
+    int t = -1;
+    int u = -1;
+    if (k == 0 || k == 1)
+    {
+        generate(c, k ? x : number(c, 0));
+        return;
+    }
+    if (k < 0)
+    {
+        generate(c, binary(c, N_SUB, number(c, 0), binary(c, N_MUL, x, number(c, -k))));
+        return;
+    }
+    for (bit = 0; 2L << bit <= k; bit++)
+    {
+    }
+    if (c->extended && k == 1L << bit)
+    {
+        generate(c, x);
+        emit(c, "SHL %d\n", bit);
+        return;
+    }
+    if (simple(x) && x->kind != N_IN)
+    {
+        source = operand(c, x, buf);
+        generate(c, x);
+    }
+    else
+    {
+        generate(c, x);
+        t = push_temp(c);
+        emit(c, "STO :_t%d\n", t);
+        sprintf(buf, ":_t%d", t);
+        source = buf;
+    }
+    if (!c->extended)
+    {
+        u = push_temp(c);
+    }
+    /* shift and add from the top bit down */
+    for (bit--; bit >= 0; bit--)
+    {
+        if (c->extended)
+        {
+            emit(c, "SHL 1\n");
+        }
+        else
+        {
+            emit(c, "STO :_t%d\nADD :_t%d\n", u, u);
+        }
+        if (k >> bit & 1)
+        {
+            emit(c, "ADD %s\n", source);
+        }
+    }
+    c->temps -= (t >= 0) + (u >= 0);
+}
+
+/* Leaves the value of n in the accumulator */
+void generate(compiler_t *c, node_t *n)
+{
+    char buf[NAME_LENGTH + 8];
+    int label;
+    int t;
+    switch (n->kind)
+    {
+        case N_NUMBER:
+            if (c->extended && n->value >= 0 && n->value <= 0xfff)
+            {
+                emit(c, "LDI %ld\n", n->value);
+                break;
+            }
+            /* fall through */
+        case N_IN:
+        case N_VARIABLE:
+            emit(c, "LDA %s\n", operand(c, n, buf));
+            break;
+        case N_INDEX:
+            t = c->extended ? push_temp(c) : -1;
+            label = element(c, n, "LDA", t);
+            if (c->extended)
+            {
+                emit(c, "LDN :_t%d\n", t);
+                c->temps--;
+            }
+            else
+            {
+                emit(c, ":_P%d\nLDA :%s\n", label, c->variables[n->value].name);
+            }
+            break;
+        case N_ADD:
+            generate_operation(c, "ADD", n->left, n->right);
+            break;
+        case N_SUB:
+            generate_operation(c, "SUB", n->left, n->right);
+            break;
+        case N_AND:
+            generate_operation(c, "AND", n->left, n->right);
+            break;
+        case N_MUL:
+            generate_multiply(c, n->left, n->right->value);
+            break;
+        default:
+            generate(c, n->left);
+            emit(c, "%s %ld\n", n->kind == N_SHL ? "SHL" : "SHR", n->right->value & 0xfff);
+            break;
+    }
+}
+
+/* Jumps to label if the condition is sense */
+void generate_jump(compiler_t *c, condition_t *cond, int sense, int label)
+{
+    /* >= and < are the two senses of each relation */
+    enum relation_t relation = sense ? cond->relation : cond->relation ^ 1;
+    node_t *l = cond->left;
+    node_t *r = cond->right;
+    int skip;
+    switch (relation)
+    {
+        case R_GE:
+            generate(c, binary(c, N_SUB, l, r));
+            break;
+        case R_LE:
+            generate(c, binary(c, N_SUB, r, l));
+            break;
+        case R_GT:
+            generate(c, binary(c, N_SUB, binary(c, N_SUB, l, r), number(c, 1)));
+            break;
+        case R_LT:
+            generate(c, binary(c, N_SUB, binary(c, N_SUB, r, l), number(c, 1)));
+            break;
+        default:
+            generate(c, binary(c, N_SUB, l, r));
+            break;
+    }
+    if (relation == R_EQ)
+    {
+        skip = new_label(c);
+        emit(c, "JNE :_L%d\nJMP :_L%d\n:_L%d\n", skip, label, skip);
+    }
+    else
+    {
+        emit(c, "%s :_L%d\n", relation == R_NE ? "JNE" : "JGE", label);
+    }
+}
+
+void parse_statement(compiler_t *c);
+
+void parse_block(compiler_t *c)
+{
+    expect_token(c, "{");
+    while (!is_token(c, "}"))
+    {
+        if (c->token[0] == '\0')
+        {
+            compile_error(c, "Expected }");
+        }
+        parse_statement(c);
+    }
+    next_token(c);
+}
+
+/* Reads a number, which may be negative */
+long parse_value(compiler_t *c)
+{
+    int negative = is_token(c, "-");
+    long value;
+    if (negative)
+    {
+        next_token(c);
+    }
+    if (!is_number(c))
+    {
+        compile_error(c, "Expected a number");
+    }
+    value = negative ? -c->number : c->number;
+    next_token(c);
+    return value;
+}
+
+void parse_declaration(compiler_t *c)
+{
+    char name[NAME_LENGTH];
+    long *values;
+    int size;
+    int i;
+    do
+    {
+        next_token(c);
+        if (!is_name(c))
+        {
+            compile_error(c, "Expected a name");
+        }
+        if (find_variable(c, c->token) >= 0 || is_keyword(c->token))
+        {
+            compile_error(c, "Declared twice");
+        }
+        strcpy(name, c->token);
+        next_token(c);
+        size = 0;
+        if (is_token(c, "["))
+        {
+            next_token(c);
+            size = is_number(c) ? c->number : 0;
+            if (size <= 0 || size >= IO_ADDRESS)
+            {
+                compile_error(c, "Expected the size of the array");
+            }
+            next_token(c);
+            expect_token(c, "]");
+        }
+        values = NULL;
+        if (is_token(c, "="))
+        {
+            next_token(c);
+            values = calloc(size ? size : 1, sizeof(long));
+            if (values == NULL)
+            {
+                fprintf(stderr, "Memory allocation error\n");
+                exit(1);
+            }
+            if (size == 0)
+            {
+                values[0] = parse_value(c);
+            }
+            else
+            {
+                expect_token(c, "{");
+                for (i = 0; !is_token(c, "}"); i++)
+                {
+                    if (i == size)
+                    {
+                        compile_error(c, "Too many values for the array");
+                    }
+                    values[i] = parse_value(c);
+                    if (!is_token(c, "}"))
+                    {
+                        expect_token(c, ",");
+                    }
+                }
+                next_token(c);
+            }
+        }
+        add_variable(c, name, size, values);
+    }
+    while (is_token(c, ","));
+    expect_token(c, ";");
+}
+
+void parse_statement(compiler_t *c)
+{
+    condition_t cond;
+    char name[NAME_LENGTH];
+    node_t *index;
+    int top;
+    int test;
+    int end;
+    int label;
+    int t;
+    int v;
+    if (is_token(c, "var"))
+    {
+        parse_declaration(c);
+    }
+    else if (is_token(c, "while"))
+    {
+        /* the test is at the bottom, so each pass takes one jump */
+        next_token(c);
+        parse_condition(c, &cond);
+        top = new_label(c);
+        test = new_label(c);
+        emit(c, "JMP :_L%d\n:_L%d\n", test, top);
+        parse_block(c);
+        emit(c, ":_L%d\n", test);
+        generate_jump(c, &cond, 1, top);
+    }
+    else if (is_token(c, "do"))
+    {
+        next_token(c);
+        top = new_label(c);
+        emit(c, ":_L%d\n", top);
+        parse_block(c);
+        expect_token(c, "while");
+        parse_condition(c, &cond);
+        generate_jump(c, &cond, 1, top);
+        expect_token(c, ";");
+    }
+    else if (is_token(c, "if"))
+    {
+        next_token(c);
+        parse_condition(c, &cond);
+        label = new_label(c);
+        generate_jump(c, &cond, 0, label);
+        parse_block(c);
+        if (is_token(c, "else"))
+        {
+            end = new_label(c);
+            emit(c, "JMP :_L%d\n:_L%d\n", end, label);
+            next_token(c);
+            if (is_token(c, "if"))
+            {
+                parse_statement(c);
+            }
+            else
+            {
+                parse_block(c);
+            }
+            label = end;
+        }
+        emit(c, ":_L%d\n", label);
+    }
+    else if (is_token(c, "out"))
+    {
+        next_token(c);
+        generate(c, parse_expression(c));
+        emit(c, "STO 0xfff\n");
+        expect_token(c, ";");
+    }
+    else if (is_token(c, "stop"))
+    {
+        next_token(c);
+        emit(c, "STP\n");
+        expect_token(c, ";");
+    }
+    else if (is_name(c) && !is_token(c, "in"))
+    {
+        strcpy(name, c->token);
+        next_token(c);
+        index = NULL;
+        if (is_token(c, "["))
+        {
+            next_token(c);
+            v = find_variable(c, name);
+            if (v < 0 || c->variables[v].size == 0)
+            {
+                compile_error(c, "Not an array");
+            }
+            index = new_node(c, N_INDEX, v, NULL, parse_expression(c));
+            expect_token(c, "]");
+        }
+        else
+        {
+            v = variable(c, name);
+            if (c->variables[v].size != 0)
+            {
+                compile_error(c, "Can't assign to an array");
+            }
+        }
+        expect_token(c, "=");
+        t = index != NULL && c->extended ? push_temp(c) : -1;
+        label = index != NULL ? element(c, index, "STO", t) : -1;
+        generate(c, parse_expression(c));
+        if (index == NULL)
+        {
+            emit(c, "STO :%s\n", name);
+        }
+        else if (c->extended)
+        {
+            emit(c, "STN :_t%d\n", t);
+            c->temps--;
+        }
+        else
+        {
+            emit(c, ":_P%d\nSTO :%s\n", label, name);
+        }
+        expect_token(c, ";");
+    }
+    else
+    {
+        compile_error(c, "Expected a statement");
+    }
+}
+
+#define HELD_LOADS 4
+
+/* Returns the name of the instruction on a line and copies the line */
+const char *instruction(const char *line, const char *eol, char *text)
+{
+    const char *p = skip_token(line, eol);
+    snprintf(text, NAME_LENGTH + 8, "%.*s", (int) (skip_token(skip_space(p, eol), eol) - line), line);
+    return p - line == 3 ? line : "";
+}
+
+/* Drops a load when the accumulator already holds what it loads: after the
+ * same load or a store of a loaded value, or after one ADD or SUB of loaded
+ * values when only a JNE looks at it, as the sum is then zero only when the
+ * stored cell is. Nothing is known after a label, and what an instruction
+ * that is patched does isn't either. */
+void peephole(text_t *in, text_t *out)
+{
+    const char *end = in->data + in->size;
+    const char *line;
+    const char *eol;
+    const char *op;
+    char held[HELD_LOADS][NAME_LENGTH + 8];  /* loads that would change nothing */
+    char text[NAME_LENGTH + 8];
+    char next[NAME_LENGTH + 8];
+    int count = 0;
+    int width = 2;  /* 0 loaded, 1 a loaded value plus or minus another, 2 unknown */
+    int patched = 0;
+    int i;
+    for (line = in->data; line < end; line = eol)
+    {
+        eol = next_line(line, end);
+        op = instruction(line, eol, text);
+        if (!strncmp(op, "STO", 3))
+        {
+            /* loading the cell stored to would give the same */
+            memcpy(text, "LDA", 3);
+        }
+        for (i = 0; i < count && strcmp(held[i], text); i++)
+        {
+        }
+        if (*line == LABEL_C)
+        {
+            count = 0;
+            width = 2;
+            patched = !strncmp(line, ":_P", 3) ? 2 : patched;
+        }
+        else if (!strncmp(op, "LDA", 3) || !strncmp(op, "LDI", 3) || !strncmp(op, "LDN", 3))
+        {
+            if (!patched && i < count && (width == 0
+                || (width == 1 && !strncmp(instruction(eol, next_line(eol, end), next), "JNE", 3))))
+            {
+                continue;
+            }
+            count = 0;
+            if (!patched && strcmp(text, "LDA 0xfff") && strncmp(op, "LDN", 3))
+            {
+                strcpy(held[count++], text);
+            }
+            width = 0;
+        }
+        else if (!strncmp(op, "STO", 3) && strcmp(text, "LDA 0xfff"))
+        {
+            if (patched || width == 2)
+            {
+                count = 0;
+            }
+            else if (i == count)
+            {
+                count -= count == HELD_LOADS;
+                strcpy(held[count++], text);
+            }
+        }
+        else if (!strncmp(op, "ADD", 3) || !strncmp(op, "SUB", 3))
+        {
+            count = 0;
+            width = width == 0 ? 1 : 2;
+        }
+        else if (strncmp(op, "STO", 3) && strncmp(op, "STN", 3) && strncmp(op, "JMP", 3)
+            && strncmp(op, "JGE", 3) && strncmp(op, "JNE", 3) && strncmp(op, "STP", 3))
+        {
+            count = 0;
+            width = 2;
+        }
+        patched -= patched > 0;
+        memcpy(text_reserve(out, eol - line), line, eol - line);
+        out->size += eol - line;
+    }
+}
+
+/* Compiles the source in file name to assembly in file output. Returns
+ * zero, or exits with the line of the first error. */
+int compile(const char *name, const char *output, int extended)
+{
+    compiler_t c;
+    text_t code;
+    source_t *src;
+    node_t *next;
+    FILE *f;
+    char buf[NAME_LENGTH + 8];
+    int i;
+    int j;
+
+    f = fopen(name, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", name);
+        exit(1);
+    }
+    src = open_source(f);
+    fclose(f);
+    memset(&c, 0, sizeof(c));
+    c.name = name;
+    c.p = src->data;
+    c.end = src->data + src->size;
+    c.line = 1;
+    c.extended = extended;
+    next_token(&c);
+    while (c.token[0] != '\0')
+    {
+        parse_statement(&c);
+    }
+    memset(&code, 0, sizeof(code));
+    peephole(&c.out, &code);
+    free(c.out.data);
+    c.out = code;
+    emit(&c, "STP\n");
+    for (i = 0; i < c.count; i++)
+    {
+        emit(&c, ":%s\n", c.variables[i].name);
+        for (j = 0; j < (c.variables[i].size ? c.variables[i].size : 1); j++)
+        {
+            emit(&c, "#%ld\n", c.variables[i].values != NULL ? c.variables[i].values[j] : 0);
+        }
+        free(c.variables[i].values);
+    }
+    for (i = 0; i < c.count; i++)
+    {
+        if (c.variables[i].size != 0)
+        {
+            /* LDA a is also the address of a */
+            emit(&c, ":_l_%s\nLDA :%s\n", c.variables[i].name, c.variables[i].name);
+            if (!extended)
+            {
+                emit(&c, ":_s_%s\nSTO :%s\n", c.variables[i].name, c.variables[i].name);
+            }
+        }
+    }
+    for (i = 0; i < c.constant_count; i++)
+    {
+        emit(&c, "%s\n#%ld\n", constant(&c, c.constants[i], buf), c.constants[i]);
+    }
+    for (i = 0; i < c.max_temps; i++)
+    {
+        emit(&c, ":_t%d\n#0\n", i);
+    }
+    close_source(src);
+    f = fopen(output, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", output);
+        exit(1);
+    }
+    fwrite(c.out.data, 1, c.out.size, f);
+    fclose(f);
+    for (; c.nodes != NULL; c.nodes = next)
+    {
+        next = c.nodes->next;
+        free(c.nodes);
+    }
+    free(c.variables);
+    free(c.constants);
+    free(c.out.data);
+    return 0;
+}
+
+/* ------------------------------------------- */
+/* --------------- SPECIALISER --------------- */
+/* ------------------------------------------- */
+
+/* Runs an image on the part of its input that is known ahead of time, up to
+ * where it would read past it, and writes memory at that point as an image
+ * that takes the rest. Whatever the known input decides, including stores
+ * over the program's own code, is then done once rather than on every run.
+ * The new image keeps every address and adds a stub after the spare word:
+ *
+ *     0       JMP stub, over the word that was at 0
+ *     1..n    memory as the run left it
+ *     stub    LDA c; STO 0xfff for each byte printed so far
+ *             LDA :w0; STO 0 to put back address 0
+ *             LDA :acc unless the next instruction loads it
+ *             JMP to the instruction that was about to read
+ */
+int specialize(const char *name, const char *known, const char *output, int extended, int limit)
+{
+    memory_t *mem;
+    source_t *input;
+    cpu_t cpu;
+    io_t io;
+    text_t out;
+    FILE *f;
+    int cells[256];
+    unsigned char bytes[256];
+    int count = 0;
+    int resume;
+    int loads;
+    int stub;
+    int next;
+    int c;
+    int i;
+
+    f = fopen(name, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", name);
+        exit(1);
+    }
+    mem = read_machine_code(f, 0);
+    fclose(f);
+    f = fopen(known, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", known);
+        exit(1);
+    }
+    input = open_source(f);
+    fclose(f);
+    memset(&io, 0, sizeof(io));
+    io.input = (const unsigned char *) input->data;
+    io.input_size = input->size;
+    mem->io = &io;
+    init_cpu(&cpu, 0);
+    if (run_guarded(&cpu, mem, 0, extended, limit, NULL, 1) == FAULT)
+    {
+        fprintf(stderr, "Memory address 0x%x is out of range\n", mem->fault_address);
+        exit(1);
+    }
+    if (!cpu.done && !(reads_input(&cpu, mem, extended) && io.input_pos >= io.input_size))
+    {
+        fprintf(stderr, "Step limit exceeded before the known input ran out\n");
+        exit(1);
+    }
+
+    /* an instruction fetched and about to read is fetched again */
+    resume = cpu.state == FETCH ? cpu.PC : cpu.PC - 1;
+    if (!cpu.done && cpu.state == EXECUTE && mem->data[resume] != cpu.IR)
+    {
+        fprintf(stderr, "Cannot resume at 0x%03x, which was stored over after it was fetched\n",
+            resume);
+        exit(1);
+    }
+    loads = cpu.state == EXECUTE
+        && (get_opcode(cpu.IR) == LDA || (extended && get_opcode(cpu.IR) == LDN));
+
+    stub = mem->size + 1;
+    next = stub + 2 * io.output_size + (cpu.done ? 1 : 3 + !loads);
+    memset(&out, 0, sizeof(out));
+    emit_word(&out, JMP << 12 | stub);
+    for (i = 1; i <= mem->size; i++)
+    {
+        emit_word(&out, mem->data[i]);
+    }
+    for (i = 0; i < 256; i++)
+    {
+        cells[i] = -1;
+    }
+    if (!cpu.done)
+    {
+        /* the word that was at 0 and the accumulator come first */
+        next += 2;
+    }
+    for (i = 0; i < io.output_size; i++)
+    {
+        c = io.output[i];
+        if (cells[c] < 0)
+        {
+            cells[c] = next++;
+            bytes[count++] = c;
+        }
+        emit_word(&out, LDA << 12 | cells[c]);
+        emit_word(&out, STO << 12 | IO_ADDRESS);
+    }
+    if (cpu.done)
+    {
+        emit_word(&out, STP << 12);
+    }
+    else
+    {
+        emit_word(&out, LDA << 12 | (next - count - 2));
+        emit_word(&out, STO << 12);
+        if (!loads)
+        {
+            emit_word(&out, LDA << 12 | (next - count - 1));
+        }
+        emit_word(&out, JMP << 12 | resume);
+        emit_word(&out, mem->data[0]);
+        emit_word(&out, cpu.ACC & 0xffff);
+    }
+    for (i = 0; i < count; i++)
+    {
+        emit_word(&out, bytes[i]);
+    }
+    if (next > ARITH_ADDRESS)
+    {
+        fprintf(stderr, "The specialised image needs %d words, more than fit below 0x%x\n",
+            next, ARITH_ADDRESS);
+        exit(1);
+    }
+
+    f = fopen(output, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", output);
+        exit(1);
+    }
+    fwrite(out.data, 1, out.size, f);
+    fclose(f);
+    printf("%s: %d cycles done ahead, %d bytes of input left unread\n", output, cpu.steps,
+        (int) (io.input_size - io.input_pos));
+    free(out.data);
+    free(io.output);
+    close_source(input);
+    free_mem(mem);
+    return 0;
+}
+
+int has_flag(int argc, char **argv, const char *flag)
+{
+    int i;
+    for (i = 0; i < argc; i++)
+    {
+        if (!strcmp(argv[i], flag))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Options that are followed by a value */
+static const char *value_options[] = {
+    "-l", "-c", "--tier1", "--tier2", "--tier3", "--cold", "--arith", "--expect",
+    "--runs", "--seed", "-o", "--reads", "--labels", "--batch", "-j", "--cosim",
+    "--cache", "--vcd", "--wave", "--lines", "--gap", "--refs", "--literals",
+    "--max", "--budget", "--scratch", NULL
+};
+
+/* Returns if argv[i] is neither an option nor an option's value */
+int is_positional(char **argv, int i)
+{
+    int j;
+    if (*argv[i] == '-')
+    {
+        return 0;
+    }
+    for (j = 0; value_options[j] != NULL; j++)
+    {
+        if (!strcmp(argv[i - 1], value_options[j]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int is_verbose(int argc, char **argv)
+{
+    return has_flag(argc, argv, "-v");
+}
+
+int is_extended(int argc, char **argv)
+{
+    return has_flag(argc, argv, "-x");
+}
+
+/* Returns NULL if not specified */
+char *string_option(int argc, char **argv, const char *flag, const char *name)
+{
+    int i;
+    for (i = 0; i < argc; i++)
+    {
+        if (!strcmp(argv[i], flag))
+        {
+            if (argc > i + 1)
+            {
+                return argv[i+1];
+            }
+            else
+            {
+                fprintf(stderr, "Must give %s with %s\n", name, flag);
+                exit(1);
+            }
+        }
+    }
+    return NULL;
+}
+
+int int_option(int argc, char **argv, const char *flag, const char *name, int def)
 {
     int i;
     for (i = 0; i < argc; i++)
     {
-        if (!strcmp(argv[i], "-l"))
+        if (!strcmp(argv[i], flag))
+        {
+            if (argc > i + 1)
+            {
+                return (int) strtol(argv[i+1], NULL, 0);
+            }
+            else
+            {
+                fprintf(stderr, "Must give %s with %s\n", name, flag);
+                exit(1);
+            }
+        }
+    }
+    return def;
+}
+
+/* Returns zero if not specified */
+int step_limit(int argc, char **argv)
+{
+    return int_option(argc, argv, "-l", "step limit", 0);
+}
+
+void tiering_options(int argc, char **argv, tiering_t *tiering)
+{
+    char *name;
+    FILE *fin;
+    tiering->tier1 = int_option(argc, argv, "--tier1", "block entry count", 16);
+    tiering->tier2 = int_option(argc, argv, "--tier2", "block run count", 1000);
+    tiering->tier3 = int_option(argc, argv, "--tier3", "block run count", 10000);
+    tiering->cold = int_option(argc, argv, "--cold", "cycle count", 1 << 20);
+    tiering->idioms = !has_flag(argc, argv, "--no-idioms");
+    tiering->stats = has_flag(argc, argv, "--stats");
+    tiering->perf_map = has_flag(argc, argv, "--perf-map");
+    tiering->jitdump = has_flag(argc, argv, "--jitdump");
+    tiering->source = NULL;
+    tiering->labels = NULL;
+    memset(&tiering->label_arena, 0, sizeof(label_arena_t));
+    name = string_option(argc, argv, "--labels", "assembly file");
+    if (name != NULL)
+    {
+        fin = fopen(name, "r");
+        if (fin == NULL)
+        {
+            fprintf(stderr, "Could not open %s\n", name);
+            exit(1);
+        }
+        tiering->source = open_source(fin);
+        fclose(fin);
+        tiering->labels = generate_label_table(tiering->source, &tiering->label_arena, 0);
+    }
+}
+
+/* Maps the arithmetic unit if --arith gives its latency */
+void arith_option(int argc, char **argv, memory_t *mem)
+{
+    mem->arith.latency = int_option(argc, argv, "--arith", "latency in cycles", -1);
+    if (mem->arith.latency >= 0 && mem->size >= ARITH_ADDRESS)
+    {
+        fprintf(stderr, "The image overlaps the arithmetic unit at 0x%x\n", ARITH_ADDRESS);
+        exit(1);
+    }
+}
+
+/* Returns NULL unless --cache names a directory */
+result_cache_t *result_cache(int argc, char **argv, memory_t *mem, int extended, int limit)
+{
+    char *dir = string_option(argc, argv, "--cache", "cache directory");
+    return dir != NULL ? new_result_cache(dir, mem, extended, limit) : NULL;
+}
+
+void free_tiering(tiering_t *tiering)
+{
+    free_labels(&tiering->label_arena);
+    if (tiering->source != NULL)
+    {
+        close_source(tiering->source);
+    }
+}
+
+/* ------------------------------------------- */
+/* ----------------- MACHINES ---------------- */
+/* ------------------------------------------- */
+
+/* A machine holds all the state of one emulation, for programs that embed
+ * the emulator, so several can run at once on different threads. Input and
+ * output are held in memory, faults end the run rather than the process,
+ * and memory may be changed between runs. */
+
+typedef struct {
+    memory_t *mem;
+    cpu_t cpu;
+    io_t io;
+    int extended;
+    tiering_t tiering;
+    tiers_t *tiers;
+    enum outcome_t outcome;
+} machine_t;
+
+/* arith is the latency of the multiply and divide unit, -1 to leave it
+ * unmapped. Returns NULL if the image overlaps the unit. */
+machine_t *new_machine(FILE *image, int extended, int arith, int tiers)
+{
+    machine_t *m = calloc(1, sizeof(machine_t));
+    if (m == NULL)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    m->mem = read_machine_code(image, 0);
+    if (arith >= 0 && m->mem->size >= ARITH_ADDRESS)
+    {
+        free_mem(m->mem);
+        free(m);
+        return NULL;
+    }
+    m->mem->arith.latency = arith;
+    m->mem->clock = &m->cpu.steps;
+    m->mem->io = &m->io;
+    /* no input reads as EOF rather than from stdin */
+    m->io.input = (const unsigned char *) "";
+    m->extended = extended;
+    tiering_options(0, NULL, &m->tiering);
+    if (!tiers)
+    {
+        m->tiering.tier1 = 0;
+    }
+    init_cpu(&m->cpu, 0);
+    m->outcome = LIMIT;
+    return m;
+}
+
+void free_machine(machine_t *m)
+{
+    if (m->tiers != NULL)
+    {
+        free_tiers(m->tiers, m->mem);
+    }
+    free(m->io.output);
+    free_mem(m->mem);
+    free(m);
+}
+
+/* The input is not copied and must last until it is replaced */
+void set_machine_input(machine_t *m, const unsigned char *input, size_t size)
+{
+    m->io.input = size > 0 ? input : (const unsigned char *) "";
+    m->io.input_size = size;
+    m->io.input_pos = 0;
+}
+
+/* Runs until the machine stops or faults, or its cycle count reaches limit
+ * if that is positive. A machine that has stopped or faulted stays so. */
+enum outcome_t run_machine(machine_t *m, int limit)
+{
+    if (m->outcome != LIMIT)
+    {
+        return m->outcome;
+    }
+    /* memory may have changed since the last run, which may have stopped
+     * anywhere, so blocks are dropped and verification starts from the PC */
+    free(m->mem->verified);
+    m->mem->verified = verify_resume(&m->cpu, m->mem, m->extended);
+    if (m->tiers != NULL)
+    {
+        reset_tiers(m->tiers, m->mem);
+    }
+    else
+    {
+        m->tiers = start_tiers(m->mem, 0, &m->tiering);
+    }
+    m->outcome = run_guarded(&m->cpu, m->mem, 0, m->extended, limit, m->tiers, 0);
+    return m->outcome;
+}
+
+/* Runs one clock cycle */
+enum outcome_t step_machine(machine_t *m)
+{
+    if (m->outcome != LIMIT)
+    {
+        return m->outcome;
+    }
+    free(m->mem->verified);
+    m->mem->verified = NULL;
+    m->outcome = run_guarded(&m->cpu, m->mem, 0, m->extended, m->cpu.steps + 1, NULL, 0);
+    return m->outcome;
+}
+
+#ifdef MU0_PYTHON
+
+/* ------------------------------------------- */
+/* ------------------ PYTHON ----------------- */
+/* ------------------------------------------- */
+
+/* make python builds this file as a CPython module named mu0 with a Machine
+ * type. Its memory is a writable buffer over the words themselves, its
+ * input is read from the object it was given without a copy, and runs
+ * release the GIL so machines on different threads run in parallel. A
+ * machine should not be touched by other threads while it runs. */
+
+typedef struct {
+    PyObject_HEAD
+    machine_t *machine;
+    Py_buffer input;     /* obj is NULL when there is none */
+    Py_ssize_t words;    /* shape of the memory buffer */
+    Py_ssize_t stride;
+    int running;
+} machine_object_t;
+
+static const char *outcome_names[] = {"stopped", "limit", "fault", "mismatch", "diverged"};
+
+static PyObject *machine_object_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"image", "extended", "arith", "tiers", NULL};
+    machine_object_t *self;
+    PyObject *image;
+    PyObject *path = NULL;
+    Py_buffer buffer;
+    FILE *f;
+    int extended = 0;
+    int arith = -1;
+    int tiers = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|pip", keywords, &image, &extended, &arith, &tiers))
+    {
+        return NULL;
+    }
+    /* an image is given as its text, or as the name of a file holding it */
+    if (PyObject_CheckBuffer(image))
+    {
+        if (PyObject_GetBuffer(image, &buffer, PyBUF_SIMPLE) < 0)
         {
-            if (argc > i + 1)
-            {
-                return (int) strtol(argv[i+1], NULL, 0);
-            }
-            else
-            {
-                fprintf(stderr, "Must give step limit with -l\n");
-                exit(1);
-            }
+            return NULL;
+        }
+        if (buffer.len == 0)
+        {
+            PyBuffer_Release(&buffer);
+            PyErr_SetString(PyExc_ValueError, "The image is empty");
+            return NULL;
+        }
+        f = fmemopen(buffer.buf, buffer.len, "r");
+    }
+    else
+    {
+        if (!PyUnicode_FSConverter(image, &path))
+        {
+            return NULL;
+        }
+        f = fopen(PyBytes_AS_STRING(path), "r");
+    }
+    if (f == NULL)
+    {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path != NULL ? image : NULL);
+        Py_XDECREF(path);
+        if (path == NULL)
+        {
+            PyBuffer_Release(&buffer);
         }
+        return NULL;
+    }
+    self = (machine_object_t *) type->tp_alloc(type, 0);
+    if (self != NULL)
+    {
+        self->machine = new_machine(f, extended, arith, tiers);
+    }
+    fclose(f);
+    if (path != NULL)
+    {
+        Py_DECREF(path);
+    }
+    else
+    {
+        PyBuffer_Release(&buffer);
+    }
+    if (self != NULL && self->machine == NULL)
+    {
+        PyErr_Format(PyExc_ValueError, "The image overlaps the arithmetic unit at 0x%x", ARITH_ADDRESS);
+        Py_CLEAR(self);
+    }
+    if (self != NULL)
+    {
+        self->words = self->machine->mem->size + 1;
+        self->stride = sizeof(uint16_t);
+    }
+    return (PyObject *) self;
+}
+
+static void machine_object_dealloc(machine_object_t *self)
+{
+    if (self->machine != NULL)
+    {
+        free_machine(self->machine);
+    }
+    if (self->input.obj != NULL)
+    {
+        PyBuffer_Release(&self->input);
+    }
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int check_idle(machine_object_t *self)
+{
+    if (self->running)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "The machine is running on another thread");
+        return 0;
+    }
+    return 1;
+}
+
+static PyObject *machine_object_run(machine_object_t *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"limit", NULL};
+    enum outcome_t outcome;
+    int limit = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i", keywords, &limit) || !check_idle(self))
+    {
+        return NULL;
+    }
+    self->running = 1;
+    Py_BEGIN_ALLOW_THREADS
+    outcome = run_machine(self->machine, limit);
+    Py_END_ALLOW_THREADS
+    self->running = 0;
+    return PyUnicode_FromString(outcome_names[outcome]);
+}
+
+static PyObject *machine_object_step(machine_object_t *self, PyObject *unused)
+{
+    if (!check_idle(self))
+    {
+        return NULL;
+    }
+    return PyUnicode_FromString(outcome_names[step_machine(self->machine)]);
+}
+
+static PyObject *machine_object_register(machine_object_t *self, void *offset)
+{
+    return PyLong_FromLong(*(int *) ((char *) &self->machine->cpu + (size_t) offset));
+}
+
+static PyObject *machine_object_get_fault_address(machine_object_t *self, void *unused)
+{
+    return PyLong_FromLong(self->machine->mem->fault_address);
+}
+
+static PyObject *machine_object_get_memory(machine_object_t *self, void *unused)
+{
+    return PyMemoryView_FromObject((PyObject *) self);
+}
+
+static PyObject *machine_object_get_input(machine_object_t *self, void *unused)
+{
+    io_t *io = &self->machine->io;
+    if (!check_idle(self))
+    {
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize((const char *) io->input + io->input_pos,
+        io->input_size - io->input_pos);
+}
+
+static int machine_object_set_input(machine_object_t *self, PyObject *value, void *unused)
+{
+    Py_buffer input;
+    if (!check_idle(self))
+    {
+        return -1;
+    }
+    if (value == NULL)
+    {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the input");
+        return -1;
+    }
+    if (PyObject_GetBuffer(value, &input, PyBUF_SIMPLE) < 0)
+    {
+        return -1;
+    }
+    if (self->input.obj != NULL)
+    {
+        PyBuffer_Release(&self->input);
+    }
+    self->input = input;
+    set_machine_input(self->machine, input.buf, input.len);
+    return 0;
+}
+
+static PyObject *machine_object_get_output(machine_object_t *self, void *unused)
+{
+    if (!check_idle(self))
+    {
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize((const char *) self->machine->io.output,
+        self->machine->io.output_size);
+}
+
+/* The words never move, so views stay valid for the life of the machine */
+static int machine_object_getbuffer(machine_object_t *self, Py_buffer *view, int flags)
+{
+    if (!check_idle(self))
+    {
+        view->obj = NULL;
+        return -1;
     }
+    view->obj = (PyObject *) self;
+    Py_INCREF(self);
+    view->buf = self->machine->mem->data;
+    view->len = self->words * self->stride;
+    view->readonly = 0;
+    view->itemsize = self->stride;
+    view->format = (flags & PyBUF_FORMAT) ? "H" : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->words : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &self->stride : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
     return 0;
 }
 
+static PyMethodDef machine_object_methods[] = {
+    {"run", (PyCFunction) (void (*)(void)) machine_object_run, METH_VARARGS | METH_KEYWORDS,
+        "run(limit=0)\n\nRuns until the machine stops, faults or has run limit cycles in all,\n"
+        "and returns which of 'stopped', 'fault' or 'limit' happened."},
+    {"step", (PyCFunction) machine_object_step, METH_NOARGS,
+        "step()\n\nRuns one clock cycle and returns like run()."},
+    {NULL}
+};
+
+static PyGetSetDef machine_object_getset[] = {
+    {"pc", (getter) machine_object_register, NULL, "program counter", (void *) offsetof(cpu_t, PC)},
+    {"acc", (getter) machine_object_register, NULL, "accumulator", (void *) offsetof(cpu_t, ACC)},
+    {"ir", (getter) machine_object_register, NULL, "instruction register", (void *) offsetof(cpu_t, IR)},
+    {"cycles", (getter) machine_object_register, NULL, "clock cycles run", (void *) offsetof(cpu_t, steps)},
+    {"done", (getter) machine_object_register, NULL, "set once STP has run", (void *) offsetof(cpu_t, done)},
+    {"fault_address", (getter) machine_object_get_fault_address, NULL,
+        "address of the access that faulted", NULL},
+    {"memory", (getter) machine_object_get_memory, NULL,
+        "writable view of the memory words, which reads and writes them in place", NULL},
+    {"input", (getter) machine_object_get_input, (setter) machine_object_set_input,
+        "input not yet read; setting it starts reading from the new object, which is not copied", NULL},
+    {"output", (getter) machine_object_get_output, NULL, "everything written to 0xfff", NULL},
+    {NULL}
+};
+
+static PyBufferProcs machine_object_buffer = {
+    (getbufferproc) machine_object_getbuffer,
+    NULL
+};
+
+static PyTypeObject machine_object_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "mu0.Machine",
+    .tp_doc = "Machine(image, extended=False, arith=-1, tiers=True)\n\n"
+        "A mu0 machine loaded from image, the text of a machine code file as bytes\n"
+        "or the name of one. arith maps the multiply and divide unit with that\n"
+        "latency, and tiers=False runs without the predecoded and native tiers.",
+    .tp_basicsize = sizeof(machine_object_t),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = machine_object_new,
+    .tp_dealloc = (destructor) machine_object_dealloc,
+    .tp_methods = machine_object_methods,
+    .tp_getset = machine_object_getset,
+    .tp_as_buffer = &machine_object_buffer
+};
+
+static struct PyModuleDef mu0_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "mu0",
+    .m_doc = "Emulator for the mu0 processor",
+    .m_size = -1
+};
+
+PyMODINIT_FUNC PyInit_mu0(void)
+{
+    PyObject *module;
+    if (PyType_Ready(&machine_object_type) < 0)
+    {
+        return NULL;
+    }
+    module = PyModule_Create(&mu0_module);
+    if (module == NULL)
+    {
+        return NULL;
+    }
+    Py_INCREF(&machine_object_type);
+    if (PyModule_AddObject(module, "Machine", (PyObject *) &machine_object_type) < 0)
+    {
+        Py_DECREF(&machine_object_type);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
+
+#else
+
 int main(int argc, char **argv)
 {
     memory_t *mem;
     FILE *fin;
-    FILE *fout;
     int verbose;
+    int extended;
     int limit;
+    int cores;
+    tiering_t tiering;
+    char **inputs;
+    int count;
+    int i;
+    char *expect_name;
+    char *cosim_name;
+    cosim_t *cosim;
+    char *wave_name;
+    wave_t *wave;
+    result_cache_t *cache;
+    source_t *input;
+    generator_t generator;
+    text_t text;
+    FILE *fout;
+    char *dir;
+    char *list;
+    int disassembling;
+    int threads;
+    assembly_job_t *jobs;
+    FILE *expect_file;
+    source_t *expect;
+    io_t io;
+    int status = 0;
 	if (argc < 3)
     {
         fprintf(stderr, "%s", USAGE);
         exit(1);
     }
     verbose = is_verbose(argc, argv);
+    extended = is_extended(argc, argv);
     limit = step_limit(argc, argv);
+    cores = int_option(argc, argv, "-c", "number of cores", 1);
     if (!strcmp(argv[1], "emulate"))
     {
         fin = fopen(argv[2], "r");
         mem = read_machine_code(fin, verbose);
-        emulate(mem, verbose, limit);
+        if (cores > 1)
+        {
+            emulate_cores(mem, verbose, extended, limit, cores, has_flag(argc, argv, "-r"));
+        }
+        else
+        {
+            arith_option(argc, argv, mem);
+            tiering_options(argc, argv, &tiering);
+            cache = result_cache(argc, argv, mem, extended, limit);
+            memset(&io, 0, sizeof(io));
+            io.print = cache == NULL;
+            input = NULL;
+            if (cache != NULL)
+            {
+                /* all of stdin is part of the key, so it is read up front */
+                input = open_source(stdin);
+                io.input = (const unsigned char *) input->data;
+                io.input_size = input->size;
+                mem->io = &io;
+            }
+            expect = NULL;
+            expect_name = string_option(argc, argv, "--expect", "expected output file");
+            if (expect_name != NULL)
+            {
+                expect_file = fopen(expect_name, "rb");
+                if (expect_file == NULL)
+                {
+                    fprintf(stderr, "Could not open %s\n", expect_name);
+                    exit(1);
+                }
+                expect = open_source(expect_file);
+                fclose(expect_file);
+                io.expect = (const unsigned char *) expect->data;
+                io.expect_size = expect->size;
+                mem->io = &io;
+            }
+            cosim_name = string_option(argc, argv, "--cosim", "co-simulation ring file");
+            cosim = cosim_name != NULL ? open_cosim(cosim_name) : NULL;
+            wave_name = string_option(argc, argv, "--wave", "waveform file");
+            wave = NULL;
+            if (wave_name != NULL || (wave_name = string_option(argc, argv, "--vcd", "VCD file")) != NULL)
+            {
+                wave = open_wave(wave_name, has_flag(argc, argv, "--wave"));
+            }
+            status = emulate(mem, verbose, extended, limit, &tiering, cosim, cache, wave);
+            if (cosim != NULL)
+            {
+                close_cosim(cosim);
+            }
+            if (input != NULL)
+            {
+                close_source(input);
+            }
+            if (expect != NULL)
+            {
+                close_source(expect);
+            }
+            free(io.output);
+            free(cache);
+            free_tiering(&tiering);
+        }
         free_mem(mem);
         fclose(fin);
     }
-    else if (!strcmp(argv[1], "assemble"))
+    else if (!strcmp(argv[1], "batch"))
     {
-        if (argc < 4)
+        fin = fopen(argv[2], "r");
+        mem = read_machine_code(fin, verbose);
+        arith_option(argc, argv, mem);
+        tiering_options(argc, argv, &tiering);
+        cache = result_cache(argc, argv, mem, extended, limit);
+        inputs = malloc(argc * sizeof(char *));
+        count = 0;
+        for (i = 3; i < argc; i++)
         {
-            fprintf(stderr, "Not enough arguments to assemble\n");
-            exit(1);
+            if (is_positional(argv, i))
+            {
+                inputs[count++] = argv[i];
+            }
         }
+        batch(mem, extended, limit, &tiering, cache, inputs, count);
+        free(cache);
+        free_tiering(&tiering);
+        free(inputs);
+        free_mem(mem);
+        fclose(fin);
+    }
+    else if (!strcmp(argv[1], "fuzz"))
+    {
         fin = fopen(argv[2], "r");
-        fout = fopen(argv[3], "w");
-        assemble(fin, fout, verbose);
-        fclose(fout);
+        mem = read_machine_code(fin, verbose);
+        inputs = malloc(argc * sizeof(char *));
+        count = 0;
+        for (i = 3; i < argc; i++)
+        {
+            if (is_positional(argv, i))
+            {
+                inputs[count++] = argv[i];
+            }
+        }
+        dir = string_option(argc, argv, "-o", "output directory");
+        fuzz(mem, extended, limit > 0 ? limit : 100000,
+            int_option(argc, argv, "--runs", "number of runs", 1000000),
+            int_option(argc, argv, "--seed", "random seed", 0),
+            dir != NULL ? dir : "fuzz", inputs, count);
+        free(inputs);
+        free_mem(mem);
+        fclose(fin);
+    }
+    else if (!strcmp(argv[1], "wcet"))
+    {
+        fin = fopen(argv[2], "r");
+        mem = read_machine_code(fin, verbose);
+        status = wcet(mem, extended, int_option(argc, argv, "--reads", "number of reads", 0), verbose);
+        free_mem(mem);
+        fclose(fin);
+    }
+    else if (!strcmp(argv[1], "assemble") || !strcmp(argv[1], "disassemble"))
+    {
+        disassembling = !strcmp(argv[1], "disassemble");
+        list = string_option(argc, argv, "--batch", "list of files");
+        if (list != NULL)
+        {
+            jobs = read_job_list(list, &count, disassembling ? ".s" : ".mu0");
+        }
+        else
+        {
+            /* pairs of input and output files */
+            inputs = malloc(argc * sizeof(char *));
+            jobs = malloc(argc * sizeof(assembly_job_t));
+            count = 0;
+            for (i = 2; i < argc; i++)
+            {
+                if (is_positional(argv, i))
+                {
+                    inputs[count++] = argv[i];
+                }
+            }
+            if (count < 2 || count % 2 != 0)
+            {
+                fprintf(stderr, "Not enough arguments to %s\n", argv[1]);
+                exit(1);
+            }
+            for (i = 0; i < count / 2; i++)
+            {
+                jobs[i].input = inputs[2 * i];
+                jobs[i].output = inputs[2 * i + 1];
+            }
+            count /= 2;
+            free(inputs);
+        }
+        threads = int_option(argc, argv, "-j", "number of threads", sysconf(_SC_NPROCESSORS_ONLN));
+        if (disassembling)
+        {
+            status = run_jobs(jobs, count, threads, verbose, extended, disassemble_file) > 0;
+        }
+        else
+        {
+            status = assemble(jobs, count, threads, verbose, extended) > 0;
+        }
+        if (list != NULL)
+        {
+            for (i = 0; i < count; i++)
+            {
+                free(jobs[i].input);
+                free(jobs[i].output);
+            }
+        }
+        free(jobs);
+    }
+    else if (!strcmp(argv[1], "vcd"))
+    {
+        fin = fopen(argv[2], "rb");
+        fout = argc > 3 ? fopen(argv[3], "w") : NULL;
+        if (fin == NULL || fout == NULL)
+        {
+            fprintf(stderr, "Could not open the wave and VCD files\n");
+            exit(1);
+        }
+        if (wave_to_vcd(fin, fout))
+        {
+            fprintf(stderr, "%s is not a wave file\n", argv[2]);
+            status = 1;
+        }
         fclose(fin);
+        fclose(fout);
+    }
+    else if (!strcmp(argv[1], "compile"))
+    {
+        if (argc < 4)
+        {
+            fprintf(stderr, "Not enough arguments to compile\n");
+            exit(1);
+        }
+        status = compile(argv[2], argv[3], extended);
+    }
+    else if (!strcmp(argv[1], "specialize"))
+    {
+        if (argc < 5)
+        {
+            fprintf(stderr, "Not enough arguments to specialize\n");
+            exit(1);
+        }
+        status = specialize(argv[2], argv[3], argv[4], extended, limit);
+    }
+    else if (!strcmp(argv[1], "superopt"))
+    {
+        status = superopt(argv[2], int_option(argc, argv, "--scratch", "number of scratch cells", 1),
+            int_option(argc, argv, "--max", "number of instructions", SUPEROPT_LENGTH),
+            int_option(argc, argv, "-j", "number of threads", sysconf(_SC_NPROCESSORS_ONLN)),
+            int_option(argc, argv, "--seed", "random seed", 0), verbose);
+    }
+    else if (!strcmp(argv[1], "generate") || !strcmp(argv[1], "benchmark"))
+    {
+        generator.gap = int_option(argc, argv, "--gap", "lines per label", 16);
+        generator.refs = reference_pattern(string_option(argc, argv, "--refs", "reference pattern"));
+        generator.literals = int_option(argc, argv, "--literals", "percent of literals", 10);
+        generator.rng = int_option(argc, argv, "--seed", "random seed", 0);
+        generator.rng = generator.rng ? generator.rng : 0x2545f4914f6cdd1d;
+        if (!strcmp(argv[1], "benchmark") && strcmp(argv[2], "assemble"))
+        {
+            fprintf(stderr, "Unknown benchmark %s\n", argv[2]);
+            exit(1);
+        }
+        if (!strcmp(argv[1], "benchmark"))
+        {
+            benchmark_assembler(&generator, int_option(argc, argv, "--max", "number of lines", 10000000),
+                int_option(argc, argv, "--budget", "number of seconds", 60), extended);
+        }
+        else
+        {
+            generator.lines = int_option(argc, argv, "--lines", "number of lines", 1000);
+            memset(&text, 0, sizeof(text));
+            generate_source(&generator, &text);
+            fout = fopen(argv[2], "w");
+            if (fout == NULL)
+            {
+                fprintf(stderr, "Could not open %s\n", argv[2]);
+                exit(1);
+            }
+            fwrite(text.data, 1, text.size, fout);
+            fclose(fout);
+            free(text.data);
+        }
     }
     else
     {
         printf("Unknown command %s\n", argv[1]);
     }
-	return 0;
+	return status;
 }
+
+#endif
@@ -0,0 +1,115 @@
+; Copies an array and sums the copy with loops that step their own LDA and
+; STO through memory, then prints the copy and the low byte of the sum.
+; The loops are the shapes the tiers run in one pass as idioms.
+:again
+LDA :copy_from
+STO :copy
+LDA :copy_to
+STO :copy_store
+LDA :sum_from
+STO :sum
+LDA :zero
+STO :total
+
+:copy
+LDA :src
+:copy_store
+STO :dst
+LDA :copy
+ADD :one
+STO :copy
+LDA :copy_store
+ADD :one
+STO :copy_store
+SUB :copy_end
+JNE :copy
+
+:sum
+LDA :dst
+ADD :total
+STO :total
+LDA :sum
+ADD :one
+STO :sum
+SUB :sum_end
+JNE :sum
+
+LDA :print_from
+STO :print
+:print
+LDA :dst
+STO 0xfff
+LDA :print
+ADD :one
+STO :print
+SUB :sum_end
+JNE :print
+LDA :total
+STO 0xfff
+
+LDA :rounds
+SUB :one
+STO :rounds
+JNE :again
+STP
+
+:zero
+#0
+:one
+#1
+:rounds
+#3
+:total
+#0
+:copy_from
+LDA :src
+:copy_to
+STO :dst
+:sum_from
+LDA :dst
+:print_from
+LDA :dst
+:copy_end
+STO :dst_end
+:sum_end
+LDA :dst_end
+
+:src
+$T
+$h
+$e
+$ 
+$q
+$u
+$i
+$c
+$k
+$ 
+$b
+$r
+$o
+$w
+$n
+$ 
+$f
+$o
+$x
+$ 
+$j
+$u
+$m
+$p
+$s
+$ 
+$o
+$v
+$e
+$r
+$.
+$
+
+.org 0x100
+:dst
+.org 0x120
+:dst_end
+#0
@@ -0,0 +1,93 @@
+#!/bin/sh
+# Runs the bundled examples and each program in this directory with every
+# tier forced on, with the idioms off and through the tiers' defaults, and
+# checks that the output, the cycle count and the exit status match the
+# plain interpreter's. Each image must also disassemble and assemble back to
+# the same bytes. A program reads name.in if there is one, and is assembled
+# and run with -x. A program with a name.out runs on four cores instead, in
+# lockstep and relaxed, and must print exactly that.
+
+MU0=${MU0:-./mu0}
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+failures=0
+
+# run <image> <input> <options>...
+run()
+{
+    image=$1
+    input=$2
+    shift 2
+    "$MU0" emulate "$image" -x -l 1000000 "$@" < "$input" 2>&1
+    printf '\nexit status %d\n' $?
+}
+
+# fail <message>
+fail()
+{
+    echo "FAIL: $1"
+    diff "$TMP/expected" "$TMP/got" | head -5
+    failures=$((failures + 1))
+}
+
+# check <name> <image> <input> <options>...
+check()
+{
+    name=$1
+    shift
+    run "$@" > "$TMP/got"
+    cmp -s "$TMP/expected" "$TMP/got" || fail "$name with $*"
+}
+
+for source in "$DIR"/../*.s "$DIR"/*.s
+do
+    name=$(basename "$source" .s)
+    image="$TMP/$name.mu0"
+    input="$DIR/$name.in"
+    [ -f "$input" ] || input=/dev/null
+    if ! "$MU0" assemble "$source" "$image" -x > /dev/null
+    then
+        echo "FAIL: $name does not assemble"
+        failures=$((failures + 1))
+        continue
+    fi
+
+    "$MU0" disassemble "$image" "$TMP/$name.dis.s" -x > /dev/null
+    "$MU0" assemble "$TMP/$name.dis.s" "$TMP/$name.dis.mu0" -x > /dev/null
+    if ! cmp -s "$image" "$TMP/$name.dis.mu0"
+    then
+        echo "FAIL: $name does not disassemble and assemble back to the same image"
+        failures=$((failures + 1))
+    fi
+
+    if [ -f "$DIR/$name.out" ]
+    then
+        cp "$DIR/$name.out" "$TMP/expected"
+        for relaxed in "" -r
+        do
+            "$MU0" emulate "$image" -x -l 1000000 -c 4 $relaxed < "$input" > "$TMP/got" 2>&1
+            cmp -s "$TMP/expected" "$TMP/got" || fail "$name on 4 cores $relaxed"
+        done
+        continue
+    fi
+
+    # expecting one byte more than the interpreter prints makes every run
+    # report the cycle it stopped on
+    "$MU0" emulate "$image" -x -l 1000000 --tier1 0 < "$input" > "$TMP/output" 2> /dev/null
+    printf '\377' >> "$TMP/output"
+    run "$image" "$input" --tier1 0 --expect "$TMP/output" > "$TMP/expected"
+    check "$name" "$image" "$input" --expect "$TMP/output"
+    check "$name" "$image" "$input" --expect "$TMP/output" --no-idioms
+    check "$name" "$image" "$input" --expect "$TMP/output" --tier1 1 --tier2 0
+    check "$name" "$image" "$input" --expect "$TMP/output" --tier1 1 --tier2 1 --tier3 0
+    check "$name" "$image" "$input" --expect "$TMP/output" --tier1 1 --tier2 1 --tier3 1
+    check "$name" "$image" "$input" --expect "$TMP/output" --tier1 1 --tier2 1 --tier3 1 --no-idioms
+done
+
+if [ "$failures" -ne 0 ]
+then
+    echo "$failures checks failed"
+    exit 1
+fi
+echo "All checks passed"
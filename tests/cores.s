@@ -0,0 +1,40 @@
+; Every core counts up a shared total under the lock until it reaches 80,
+; and the last core to finish prints it, as a P
+:take
+LDA 0xffe
+JNE :take
+LDA :count
+SUB :total
+JGE :finish
+LDA :count
+ADD :one
+STO :count
+LDA :zero
+STO 0xffe
+JMP :take
+
+:finish
+LDA :done
+ADD :one
+STO :done
+SUB :cores
+JNE :leave
+LDA :count
+STO 0xfff
+:leave
+LDA :zero
+STO 0xffe
+STP
+
+:count
+#0
+:total
+#80
+:done
+#0
+:cores
+#4
+:zero
+#0
+:one
+#1
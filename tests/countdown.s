@@ -0,0 +1,30 @@
+; Nested count down loops, hot enough for the inner one to become a trace
+; that keeps its counter in a register, printing a letter per outer pass
+:outer
+LDA :start
+STO :i
+:inner
+LDA :i
+SUB :one
+STO :i
+JNE :inner
+LDA :letter
+ADD :one
+STO :letter
+STO 0xfff
+LDA :j
+SUB :one
+STO :j
+JNE :outer
+STP
+
+:i
+#0
+:j
+#5
+:start
+#1000
+:one
+#1
+:letter
+$`
@@ -0,0 +1,28 @@
+; LDN loads a negative word, which every tier has to sign extend
+:loop
+LDN :ptr
+JGE :positive
+LDA :neg_c
+JMP :print
+:positive
+LDA :pos_c
+:print
+STO 0xfff
+LDA :count
+SUB :one
+STO :count
+JNE :loop
+STP
+
+:ptr
+LDA :value
+:value
+#0xff41
+:count
+#4
+:one
+#1
+:neg_c
+$N
+:pos_c
+$P